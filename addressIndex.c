@@ -0,0 +1,274 @@
+//addressToSymbol, our dladdr: which library and function an address such as a sampled PC is in.
+//all libraries we mapped are kept in one array sorted by address, and every library gets a sorted array
+//of its function symbols the first time an address falls into it, so a lookup is two binary searches.
+//lookups take no lock: the range array is replaced, never changed in place, and what a lookup may still
+//be reading is freed two epochs later. Lookups count themselves in the epoch they start in, and the epoch
+//only moves on once nobody is left in the one before, so whatever was retired then can't be in use any more.
+//Like dladdr, an address of a library that is being closed at the same time is the caller's problem.
+//scope indexes are looked up without a lock as well, and retired through the same epochs, see resolveLoaded
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+struct libraryRange
+{
+    uint64_t start, end;
+    Library *lib;
+};
+
+struct addressIndex
+{
+    int n;
+    struct libraryRange ranges[];
+};
+
+//function symbols of one library, sorted by start, as offsets from its load address
+struct funcIndex
+{
+    uint32_t n;
+    uint64_t *starts; //searched alone, so a binary search touches as few lines as possible
+    uint64_t *sizes;
+    uint32_t *names; //into the library's strtab
+};
+
+//replaced arrays and function indexes of closed libraries, waiting for the lookups that may hold them
+struct retired
+{
+    void *ptr;
+    struct retired *next;
+};
+
+static struct addressIndex *currentIndex = NULL;
+static uint64_t indexEpoch = 0;
+static int indexReaders[2]; //lookups running, by the parity of the epoch they started in
+static struct retired *retiredList[2]; //retired during an epoch of that parity
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t funcIndexLock = PTHREAD_MUTEX_INITIALIZER;
+//what func_index of a removed library points at, so a late lookup finds no functions instead of building some
+static struct funcIndex removedFuncs = {0};
+
+extern uint32_t symbolCount(Library *lib);
+
+static int advance(void)
+{
+    //call with retireLock held. Once nobody is left in the epoch before this one, what was retired in it
+    //is unreachable: lookups of older epochs were gone when this one began. 1 if the epoch moved on
+    uint64_t epoch = __atomic_load_n(&indexEpoch, __ATOMIC_SEQ_CST);
+    int prev = (epoch + 1) & 1;
+    if(__atomic_load_n(&indexReaders[prev], __ATOMIC_SEQ_CST) != 0)
+        return 0;
+    struct retired *r = retiredList[prev];
+    retiredList[prev] = NULL;
+    while(r)
+    {
+        struct retired *next = r->next;
+        free(r->ptr);
+        free(r);
+        r = next;
+    }
+    //lookups starting from now count in prev, which is empty, and retire into the list just freed
+    __atomic_store_n(&indexEpoch, epoch + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+static void reclaim(void)
+{
+    //twice at most, after that both lists are empty or somebody is still reading
+    for(int i = 0; i < 2 && (retiredList[0] || retiredList[1]) && advance(); i++)
+        ;
+}
+
+void epochRetire(void *ptr)
+{
+    //call with the registry locked, like everything changing the index
+    struct retired *r = malloc(sizeof(struct retired));
+    r->ptr = ptr;
+    pthread_mutex_lock(&retireLock);
+    int cur = __atomic_load_n(&indexEpoch, __ATOMIC_SEQ_CST) & 1;
+    r->next = retiredList[cur];
+    retiredList[cur] = r;
+    reclaim();
+    pthread_mutex_unlock(&retireLock);
+}
+
+int epochEnter(void)
+{
+    //count ourselves in the current epoch, again if it moved on meanwhile, since advance may not have seen us
+    while(1)
+    {
+        uint64_t epoch = __atomic_load_n(&indexEpoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&indexReaders[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&indexEpoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch & 1;
+        __atomic_sub_fetch(&indexReaders[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void epochLeave(int parity)
+{
+    //the last one out of an epoch frees what it was holding up, unless somebody is at it already.
+    //a sampling profiler is never out of lookups, so waiting for none at all would never free anything
+    if(__atomic_sub_fetch(&indexReaders[parity], 1, __ATOMIC_SEQ_CST) != 0)
+        return;
+    if(!__atomic_load_n(&retiredList[0], __ATOMIC_RELAXED) && !__atomic_load_n(&retiredList[1], __ATOMIC_RELAXED))
+        return;
+    if(pthread_mutex_trylock(&retireLock) != 0)
+        return;
+    reclaim();
+    pthread_mutex_unlock(&retireLock);
+}
+
+static void publish(struct addressIndex *idx)
+{
+    struct addressIndex *old = currentIndex;
+    __atomic_store_n(&currentIndex, idx, __ATOMIC_SEQ_CST);
+    if(old)
+        epochRetire(old);
+}
+
+void addressIndexAdd(Library *lib)
+{
+    //after mapSegment, with the registry locked
+    int n = currentIndex ? currentIndex->n : 0, i = 0;
+    struct addressIndex *idx = malloc(sizeof(struct addressIndex) + (n + 1) * sizeof(struct libraryRange));
+    for(; i < n && currentIndex->ranges[i].start < lib->addr; i++)
+        idx->ranges[i] = currentIndex->ranges[i];
+    idx->ranges[i] = (struct libraryRange){lib->addr, lib->addr + lib->maplength, lib};
+    for(; i < n; i++)
+        idx->ranges[i + 1] = currentIndex->ranges[i];
+    idx->n = n + 1;
+    publish(idx);
+}
+
+void addressIndexRemove(Library *lib)
+{
+    //before lib is unmapped, with the registry locked
+    int n = currentIndex ? currentIndex->n : 0, j = 0;
+    struct addressIndex *idx = malloc(sizeof(struct addressIndex) + (n + 1) * sizeof(struct libraryRange));
+    for(int i = 0; i < n; i++)
+        if(currentIndex->ranges[i].lib != lib)
+            idx->ranges[j++] = currentIndex->ranges[i];
+    if(j == n)
+    {
+        free(idx); //never made it into the index, a fake object say
+        return;
+    }
+    idx->n = j;
+    publish(idx);
+    //under funcIndexLock, so a lookup that found lib in an older array can't build one after this
+    pthread_mutex_lock(&funcIndexLock);
+    struct funcIndex *f = lib->func_index;
+    __atomic_store_n(&lib->func_index, &removedFuncs, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&funcIndexLock);
+    if(f)
+        epochRetire(f); //starts, sizes and names live in the same block
+}
+
+static int compareFunc(const void *a, const void *b)
+{
+    const Elf64_Sym *x = *(const Elf64_Sym **)a, *y = *(const Elf64_Sym **)b;
+    return (x->st_value > y->st_value) - (x->st_value < y->st_value);
+}
+
+static struct funcIndex *buildFuncIndex(Library *lib)
+{
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    uint32_t total = symbolCount(lib), n = 0;
+    Elf64_Sym **funcs = malloc((total + 1) * sizeof(Elf64_Sym *));
+    for(uint32_t i = 0; i < total; i++)
+    {
+        int type = ELF64_ST_TYPE(symtab[i].st_info);
+        if((type == STT_FUNC || type == STT_GNU_IFUNC) && symtab[i].st_shndx != SHN_UNDEF && symtab[i].st_value)
+            funcs[n++] = &symtab[i];
+    }
+    qsort(funcs, n, sizeof(Elf64_Sym *), compareFunc);
+
+    //one block, so retiring it is one free
+    struct funcIndex *f = malloc(sizeof(struct funcIndex) + n * (2 * sizeof(uint64_t) + sizeof(uint32_t)));
+    f->starts = (uint64_t *)(f + 1);
+    f->sizes = f->starts + n;
+    f->names = (uint32_t *)(f->sizes + n);
+    f->n = 0;
+    for(uint32_t i = 0; i < n; i++)
+    {
+        if(f->n && f->starts[f->n - 1] == funcs[i]->st_value)
+            continue; //an alias, the first name will do
+        f->starts[f->n] = funcs[i]->st_value;
+        f->sizes[f->n] = funcs[i]->st_size;
+        f->names[f->n] = funcs[i]->st_name;
+        f->n++;
+    }
+    free(funcs);
+    return f;
+}
+
+static struct funcIndex *funcIndexOf(Library *lib)
+{
+    struct funcIndex *f = __atomic_load_n(&lib->func_index, __ATOMIC_ACQUIRE);
+    if(f)
+        return f;
+    pthread_mutex_lock(&funcIndexLock);
+    f = lib->func_index;
+    if(!f)
+    {
+        f = buildFuncIndex(lib);
+        __atomic_store_n(&lib->func_index, f, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&funcIndexLock);
+    return f;
+}
+
+int addressToSymbol(const void *address, struct symbolInfo *info)
+{
+    uint64_t addr = (uint64_t)address;
+    int found = 0;
+    int parity = epochEnter();
+    struct addressIndex *idx = __atomic_load_n(&currentIndex, __ATOMIC_SEQ_CST);
+
+    //the last library starting at or below addr
+    int lo = 0, hi = idx ? idx->n : 0;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(idx->ranges[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo > 0 && addr < idx->ranges[lo - 1].end)
+    {
+        Library *lib = idx->ranges[lo - 1].lib;
+        info->library = lib;
+        info->library_name = lib->name;
+        info->base = (void *)lib->addr;
+        info->symbol = NULL;
+        info->start = NULL;
+        info->size = 0;
+
+        //same again over the functions, a symbol without a size covers up to the next one
+        struct funcIndex *f = funcIndexOf(lib);
+        uint64_t offset = addr - lib->addr;
+        uint32_t flo = 0, fhi = f->n;
+        while(flo < fhi)
+        {
+            uint32_t mid = (flo + fhi) / 2;
+            if(f->starts[mid] <= offset)
+                flo = mid + 1;
+            else
+                fhi = mid;
+        }
+        if(flo > 0 && (f->sizes[flo - 1] == 0 || offset < f->starts[flo - 1] + f->sizes[flo - 1]))
+        {
+            const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+            info->symbol = strtab + f->names[flo - 1];
+            info->start = (void *)(lib->addr + f->starts[flo - 1]);
+            info->size = f->sizes[flo - 1];
+        }
+        found = 1;
+    }
+    epochLeave(parity);
+    return found;
+}
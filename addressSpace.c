@@ -0,0 +1,141 @@
+//hand out load addresses when the caller doesn't dictate one, and take them back on closeLibrary
+//we reserve big PROT_NONE arenas and carve them first-fit, so freed holes get reused
+//instead of the process slowly fragmenting its address space
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define ARENA_SIZE (16ul << 30) //only address space, nothing is committed until mapped
+
+struct range
+{
+    uint64_t start, end;
+    struct range *next; //sorted by address
+};
+
+struct arena
+{
+    uint64_t start, end;
+    struct arena *next;
+};
+
+static pthread_mutex_t spaceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct range *freeRanges = NULL;
+static struct arena *arenas = NULL;
+
+static void insertFree(uint64_t start, uint64_t end)
+{
+    //put [start, end) back in address order and merge it with its neighbours
+    struct range **link = &freeRanges;
+    while (*link && (*link)->end < start)
+        link = &(*link)->next;
+    struct range *r = *link;
+    if (r && r->end == start)
+    {
+        r->end = end;
+        if (r->next && r->next->start == end)
+        {
+            struct range *dead = r->next;
+            r->end = dead->end;
+            r->next = dead->next;
+            free(dead);
+        }
+        return;
+    }
+    if (r && r->start == end)
+    {
+        r->start = start;
+        return;
+    }
+    struct range *n = malloc(sizeof(struct range));
+    n->start = start;
+    n->end = end;
+    n->next = r;
+    *link = n;
+}
+
+static int newArena(uint64_t atleast)
+{
+    uint64_t size = atleast > ARENA_SIZE ? atleast : ARENA_SIZE;
+    void *p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    struct arena *a = malloc(sizeof(struct arena));
+    a->start = (uint64_t)p;
+    a->end = a->start + size;
+    a->next = arenas;
+    arenas = a;
+    insertFree(a->start, a->end);
+    return 0;
+}
+
+uint64_t allocRangeAligned(uint64_t len, uint64_t align, uint64_t offset)
+{
+    //first fit for a range whose byte at `offset` is `align` aligned, holes on either side stay free
+    //the range stays reserved as PROT_NONE until mapSegment maps over it
+    pthread_mutex_lock(&spaceLock);
+    for (int tries = 0; tries < 2; tries++)
+    {
+        for (struct range **link = &freeRanges; *link; link = &(*link)->next)
+        {
+            struct range *r = *link;
+            uint64_t start = ((r->start + offset + align - 1) & -align) - offset;
+            if (start < r->start || start + len > r->end)
+                continue;
+            if (start + len < r->end)
+            {
+                //keep the tail
+                struct range *tail = malloc(sizeof(struct range));
+                tail->start = start + len;
+                tail->end = r->end;
+                tail->next = r->next;
+                r->next = tail;
+            }
+            r->end = start;
+            if (r->start == r->end)
+            {
+                *link = r->next;
+                free(r);
+            }
+            pthread_mutex_unlock(&spaceLock);
+            return start;
+        }
+        if (newArena(len + align) < 0)
+            break;
+    }
+    pthread_mutex_unlock(&spaceLock);
+    fprintf(stderr, "addressSpace error: cannot find %lu bytes of address space\n", len);
+    exit(-1);
+}
+
+uint64_t allocRange(uint64_t len)
+{
+    return allocRangeAligned(len, getpagesize(), 0);
+}
+
+int inArena(uint64_t addr)
+{
+    pthread_mutex_lock(&spaceLock);
+    struct arena *a = arenas;
+    while (a && !(addr >= a->start && addr < a->end))
+        a = a->next;
+    pthread_mutex_unlock(&spaceLock);
+    return a != NULL;
+}
+
+void releaseRange(uint64_t start, uint64_t len)
+{
+    //unmap a library; arena ranges go back to PROT_NONE and to the free list, others are plainly unmapped
+    if (!inArena(start))
+    {
+        munmap((void *)start, len);
+        return;
+    }
+    mmap((void *)start, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    pthread_mutex_lock(&spaceLock);
+    insertFree(start, start + len);
+    pthread_mutex_unlock(&spaceLock);
+}
@@ -0,0 +1,176 @@
+//openLibraryAsync: the whole openLibrary runs on a background thread, the caller gets a handle at once.
+//the handle is a Library of its own with only `async` set, every public call taking a library sees
+//through it with libraryOf, waiting for the load if need be (findSymbol may give up, see ASYNC_FAIL_FAST)
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+//mapping is one thread at a time anyway, but relocating isn't, and one slow load shouldn't hold up the rest
+#define ASYNC_MAX_WORKERS 4
+
+struct asyncOpen
+{
+    char *name;
+    int mode;
+    void *addr;
+    libraryCallback callback;
+    void *arg;
+    Library *lib; //what openLibrary gave, valid once done, or in the callback
+    int taken; //a thread is loading it, it's off the queue
+    int done;
+    pthread_t loader; //who took it
+    struct asyncOpen *next; //in the queue
+};
+
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncQueued = PTHREAD_COND_INITIALIZER, asyncFinished = PTHREAD_COND_INITIALIZER;
+static struct asyncOpen *asyncFirst, *asyncLast;
+static int asyncWorkers, asyncIdle;
+
+static void unqueue(struct asyncOpen *job)
+{
+    //call with asyncLock held
+    struct asyncOpen **link = &asyncFirst, *prev = NULL;
+    while(*link != job)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    if(asyncLast == job)
+        asyncLast = prev;
+    job->next = NULL;
+    job->taken = 1;
+    job->loader = pthread_self();
+}
+
+static void runJob(struct asyncOpen *job)
+{
+    //call with asyncLock held and job taken, returns with it held again
+    pthread_mutex_unlock(&asyncLock);
+    Library *lib = openLibrary(job->name, job->mode, job->addr);
+    job->lib = lib; //for waitLibrary in the callback
+    //before done, so closing the handle can't take the library away from under the callback
+    if(job->callback)
+        job->callback(lib, job->arg);
+    pthread_mutex_lock(&asyncLock);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&asyncFinished);
+}
+
+static void *asyncWorker(void *unused)
+{
+    pthread_mutex_lock(&asyncLock);
+    while(1)
+    {
+        asyncIdle++;
+        while(!asyncFirst)
+            pthread_cond_wait(&asyncQueued, &asyncLock);
+        asyncIdle--;
+        struct asyncOpen *job = asyncFirst;
+        unqueue(job);
+        runJob(job);
+    }
+    return NULL;
+}
+
+void *openLibraryAsync(const char *name, int mode, void *addr, libraryCallback callback, void *arg)
+{
+    struct asyncOpen *job = calloc(1, sizeof(struct asyncOpen));
+    job->name = strdup(name);
+    job->mode = mode;
+    job->addr = addr;
+    job->callback = callback;
+    job->arg = arg;
+    Library *handle = calloc(1, sizeof(Library));
+    handle->name = strdup(name);
+    handle->async = job;
+
+    pthread_mutex_lock(&asyncLock);
+    if(asyncLast)
+        asyncLast->next = job;
+    else
+        asyncFirst = job;
+    asyncLast = job;
+    //one more thread if everybody is busy, as long as there's room
+    if(asyncIdle == 0 && asyncWorkers < ASYNC_MAX_WORKERS)
+    {
+        pthread_t worker;
+        if(pthread_create(&worker, NULL, asyncWorker, NULL) == 0)
+        {
+            pthread_detach(worker);
+            asyncWorkers++;
+        }
+        else if(asyncWorkers == 0)
+        {
+            fprintf(stderr, "openLibraryAsync error: cannot start the background thread for %s\n", name);
+            exit(-1);
+        }
+    }
+    pthread_cond_signal(&asyncQueued);
+    pthread_mutex_unlock(&asyncLock);
+    return handle;
+}
+
+int libraryReady(void *handle)
+{
+    Library *lib = handle;
+    return !lib->async || __atomic_load_n(&lib->async->done, __ATOMIC_ACQUIRE);
+}
+
+void *waitLibrary(void *handle)
+{
+    Library *lib = handle;
+    struct asyncOpen *job = lib->async;
+    if(!job)
+        return lib; //an openLibrary one, ready all along
+    if(__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return job->lib;
+    pthread_mutex_lock(&asyncLock);
+    if(!job->taken)
+    {
+        unqueue(job); //still queued, we may as well load it ourselves
+        runJob(job);
+    }
+    else if(pthread_equal(job->loader, pthread_self()))
+    {
+        //the callback of this very load: the library is there, it just isn't done
+        pthread_mutex_unlock(&asyncLock);
+        return job->lib;
+    }
+    while(!job->done)
+        pthread_cond_wait(&asyncFinished, &asyncLock);
+    pthread_mutex_unlock(&asyncLock);
+    return job->lib;
+}
+
+Library *asyncTarget(Library *handle)
+{
+    //the library behind handle for findSymbol, NULL when it's still loading and we were told not to wait
+    struct asyncOpen *job = handle->async;
+    if(__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return job->lib;
+    if(job->mode & ASYNC_FAIL_FAST)
+        return NULL;
+    return waitLibrary(handle);
+}
+
+Library *libraryOf(void *library)
+{
+    //what a public call taking a library works on, the loaded library if it got a handle
+    Library *lib = library;
+    return lib->async ? waitLibrary(lib) : lib;
+}
+
+void asyncClose(Library *handle)
+{
+    //the load can't be called off, so wait for it and drop the reference it took
+    closeLibrary(waitLibrary(handle));
+    free(handle->async->name);
+    free(handle->async);
+    free(handle->name);
+    free(handle);
+}
@@ -0,0 +1,114 @@
+//open libraries whose DT_NEEDED entries form a cycle, every way that used to hang or crash
+//usage: cycle <dir>
+//libcyca.so needs libcycb.so, which needs libcyca.so back. libcyca exports an IFUNC whose resolver reads
+//a variable of libcycb through its GOT, and libcycb takes the address of that IFUNC, so with LAZY_LOAD
+//libcycb is loaded and relocated from inside the relocation of libcyca, before its resolver can run.
+//every mode is also run with both ends opened at once from two threads, each taking the other as a dependency
+//and once both are closed, the cycle must be unloaded although each end still holds the other
+#include "../dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char *sourceA =
+    "extern int cyc_sel;\n"
+    "static int impl0(int x) { return x; }\n"
+    "static int impl1(int x) { return x + 1000; }\n"
+    "static void *cyc_pick(void) { return cyc_sel ? impl1 : impl0; }\n"
+    "int cyc_fn(int) __attribute__((ifunc(\"cyc_pick\")));\n"
+    "int cyc_a(int x) { return cyc_fn(x); }\n";
+
+static const char *sourceB =
+    "int cyc_sel = 1;\n"
+    "extern int cyc_fn(int);\n"
+    "int (*cyc_fp)(int) = cyc_fn;\n"
+    "int cyc_b(int x) { return cyc_fp(x) + 1; }\n";
+
+static void build(const char *dir, const char *name, const char *source, const char *needs)
+{
+    //with a soname, so the DT_NEEDED of the other end finds the library already open
+    char src[4096], cmd[16384];
+    snprintf(src, sizeof(src), "%s/lib%s.c", dir, name);
+    FILE *f = fopen(src, "w");
+    if(!f)
+    {
+        fprintf(stderr, "cycle error: cannot write %s\n", src);
+        exit(-1);
+    }
+    fputs(source, f);
+    fclose(f);
+    int n = snprintf(cmd, sizeof(cmd), "gcc -shared -fPIC -O1 -o %s/lib%s.so %s -Wl,-soname,lib%s.so -Wl,-rpath,%s",
+        dir, name, src, name, dir);
+    if(needs)
+        snprintf(cmd + n, sizeof(cmd) - n, " -L%s -l%s", dir, needs);
+    if(system(cmd) != 0)
+    {
+        fprintf(stderr, "cycle error: failed to build lib%s.so\n", name);
+        exit(-1);
+    }
+}
+
+static int openCycle(const char *dir, int mode, int together)
+{
+    //1 if both ends of the cycle give the right answers, and go away once closed
+    char path[4096], pathB[4096];
+    snprintf(path, sizeof(path), "%s/libcyca.so", dir);
+    snprintf(pathB, sizeof(pathB), "%s/libcycb.so", dir);
+    void *a, *b;
+    if(together)
+    {
+        a = openLibraryAsync(path, mode, NULL, NULL, NULL);
+        b = openLibraryAsync(pathB, mode, NULL, NULL, NULL);
+    }
+    else
+    {
+        a = openLibrary(path, mode, NULL);
+        b = openLibrary("libcycb.so", mode, NULL); //known by now, whichever way it was loaded
+    }
+    int (*cyc_a)(int) = findSymbol(a, "cyc_a");
+    int (*cyc_b)(int) = findSymbol(b, "cyc_b");
+    int ok = cyc_a && cyc_b && cyc_a(1) == 1001 && cyc_b(1) == 1002;
+    closeLibrary(b);
+    closeLibrary(a);
+    struct symbolInfo info;
+    return ok && !addressToSymbol(cyc_a, &info); //nothing else holds the cycle, it's gone
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s <dir>\n", argv[0]);
+        return -1;
+    }
+    const char *dir = argv[1];
+    //a first without the other, then b against it, then a again against that b
+    build(dir, "cycb", sourceB, NULL);
+    build(dir, "cyca", sourceA, "cycb");
+    build(dir, "cycb", sourceB, "cyca");
+
+    //a process per mode, so every one starts from nothing loaded and a crash is just a failure
+    const int modes[] = {BIND_NOW, LAZY_BIND, SCOPE_INDEX, LAZY_LOAD, LAZY_LOAD | LAZY_BIND, LAZY_LOAD | SCOPE_INDEX};
+    const int nmodes = sizeof(modes) / sizeof(modes[0]);
+    int failures = 0;
+    for(int i = 0; i < 2 * nmodes; i++)
+    {
+        int mode = modes[i % nmodes], together = i >= nmodes;
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            alarm(30); //a deadlock is a failure too
+            _exit(!openCycle(dir, mode, together));
+        }
+        int status;
+        if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "cycle: mode %d%s failed\n", mode, together ? " from two threads" : "");
+            failures++;
+        }
+    }
+    printf("{\"case\": \"cycle\", \"runs\": %d, \"failures\": %d}\n", 2 * nmodes, failures);
+    return failures != 0;
+}
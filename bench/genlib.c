@@ -0,0 +1,87 @@
+//generate a chain of synthetic shared objects for the benchmark
+//usage: genlib <outdir> <name> <depth> <symbols> <relocs> <plt>
+//lib<name>0.so needs lib<name>1.so, which needs lib<name>2.so ... down to lib<name><depth-1>.so
+//every library i defines <symbols> variables l<i>_s<k> and <plt> functions l<i>_f<k>,
+//and except the last one it has <relocs> data relocations (half relative, half against
+//the variables of library i+1) and <plt> PLT slots calling the functions of library i+1.
+//the head also exports call_all(), which goes through each of its PLT slots once
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static void writeSource(const char *path, int i, int depth, int nsyms, int nrelocs, int nplt)
+{
+    FILE *f = fopen(path, "w");
+    if(!f)
+    {
+        fprintf(stderr, "genlib error: cannot write %s\n", path);
+        exit(-1);
+    }
+    int last = i == depth - 1;
+    for(int k = 0; k < nsyms; k++)
+        fprintf(f, "int l%d_s%d = %d;\n", i, k, k);
+    for(int k = 0; k < nplt; k++)
+        fprintf(f, "int l%d_f%d(int x) { return x + %d; }\n", i, k, k);
+    if(last)
+    {
+        fclose(f);
+        return;
+    }
+
+    //relative ones point into our own hidden data, symbolic ones into the next library
+    fprintf(f, "__attribute__((visibility(\"hidden\"))) int l%d_own[%d];\n", i, nrelocs / 2 + 1);
+    fprintf(f, "void *l%d_rel[] = {\n", i);
+    for(int k = 0; k < nrelocs / 2; k++)
+        fprintf(f, "    &l%d_own[%d],\n", i, k);
+    fprintf(f, "    0 };\n");
+    for(int k = 0; k < nrelocs - nrelocs / 2; k++)
+        fprintf(f, "extern int l%d_s%d;\n", i + 1, k % nsyms);
+    fprintf(f, "void *l%d_sym[] = {\n", i);
+    for(int k = 0; k < nrelocs - nrelocs / 2; k++)
+        fprintf(f, "    &l%d_s%d,\n", i + 1, k % nsyms);
+    fprintf(f, "    0 };\n");
+
+    for(int k = 0; k < nplt; k++)
+        fprintf(f, "extern int l%d_f%d(int);\n", i + 1, k);
+    fprintf(f, "int l%d_call_all(int x)\n{\n", i);
+    for(int k = 0; k < nplt; k++)
+        fprintf(f, "    x = l%d_f%d(x);\n", i + 1, k);
+    fprintf(f, "    return x;\n}\n");
+    if(i == 0)
+        fprintf(f, "int call_all(int x) { return l0_call_all(x); }\n");
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 7)
+    {
+        fprintf(stderr, "usage: %s <outdir> <name> <depth> <symbols> <relocs> <plt>\n", argv[0]);
+        return -1;
+    }
+    const char *dir = argv[1], *name = argv[2];
+    int depth = atoi(argv[3]), nsyms = atoi(argv[4]), nrelocs = atoi(argv[5]), nplt = atoi(argv[6]);
+    if(depth < 1 || nsyms < 1)
+    {
+        fprintf(stderr, "genlib error: need at least one library and one symbol\n");
+        return -1;
+    }
+
+    //deepest first, so every library can be linked against the one it needs
+    for(int i = depth - 1; i >= 0; i--)
+    {
+        char src[4096], cmd[16384];
+        snprintf(src, sizeof(src), "%s/lib%s%d.c", dir, name, i);
+        writeSource(src, i, depth, nsyms, nrelocs, nplt);
+        int n = snprintf(cmd, sizeof(cmd), "gcc -shared -fPIC -O1 -o %s/lib%s%d.so %s -Wl,-rpath,%s",
+            dir, name, i, src, dir);
+        if(i != depth - 1)
+            snprintf(cmd + n, sizeof(cmd) - n, " -L%s -l%s%d", dir, name, i + 1);
+        if(system(cmd) != 0)
+        {
+            fprintf(stderr, "genlib error: failed to build lib%s%d.so\n", name, i);
+            return -1;
+        }
+    }
+    return 0;
+}
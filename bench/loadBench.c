@@ -0,0 +1,215 @@
+//time libredl against glibc's dlopen/dlsym on a chain made by genlib
+//usage: loadBench <dir> <name> <depth> <symbols> <plt>
+//every configuration runs in its own child process, and prints one JSON object per line
+#include "../dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+
+#define PLT_ROUNDS 1000
+#define LOOKUP_ROUNDS 10
+
+//phases of openLibrary, called one by one so each can be timed
+extern void *mapLibrary(const char *name, void *addr, int mode);
+extern void relocChain(void *head, int mode);
+
+struct benchCase
+{
+    const char *name;
+    int depth, nsyms, nplt;
+    char path[4096]; //of the head
+    char **names; //nsyms defined by the head, then as many it doesn't define
+};
+
+struct result
+{
+    double open_us, map_us, reloc_us;
+    double lookup_ns, batch_lookup_ns;
+    double plt_first_ns, plt_steady_ns;
+    long rss_kb;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long rssKb(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f)
+        return 0;
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (getpagesize() / 1024);
+}
+
+static void timePLT(struct benchCase *c, int (*call_all)(int), struct result *r)
+{
+    //the first round binds every slot when lazy, the others are the steady state
+    double t0 = now();
+    volatile int x = call_all(1);
+    double t1 = now();
+    for(int i = 0; i < PLT_ROUNDS; i++)
+        x = call_all(x);
+    double t2 = now();
+    r->plt_first_ns = (t1 - t0) / c->nplt;
+    r->plt_steady_ns = (t2 - t1) / ((double)PLT_ROUNDS * c->nplt);
+}
+
+static void benchRedl(struct benchCase *c, int mode, struct result *r)
+{
+    long rss0 = rssKb();
+    double t0 = now();
+    void *lib = mapLibrary(c->path, NULL, mode);
+    double t1 = now();
+    relocChain(lib, mode);
+    double t2 = now();
+    r->map_us = (t1 - t0) / 1e3;
+    r->reloc_us = (t2 - t1) / 1e3;
+    r->open_us = (t2 - t0) / 1e3;
+
+    int n = c->nsyms * 2;
+    void **out = malloc(n * sizeof(void *));
+    t0 = now();
+    for(int round = 0; round < LOOKUP_ROUNDS; round++)
+        for(int i = 0; i < n; i++)
+            out[i] = findSymbol(lib, c->names[i]);
+    t1 = now();
+    for(int round = 0; round < LOOKUP_ROUNDS; round++)
+        findSymbols(lib, (const char **)c->names, n, out);
+    t2 = now();
+    r->lookup_ns = (t1 - t0) / ((double)LOOKUP_ROUNDS * n);
+    r->batch_lookup_ns = (t2 - t1) / ((double)LOOKUP_ROUNDS * n);
+    free(out);
+
+    timePLT(c, findSymbol(lib, "call_all"), r);
+    r->rss_kb = rssKb() - rss0;
+}
+
+static void benchGlibc(struct benchCase *c, int mode, struct result *r)
+{
+    long rss0 = rssKb();
+    double t0 = now();
+    void *lib = dlopen(c->path, (mode & LAZY_BIND) ? RTLD_LAZY : RTLD_NOW);
+    double t1 = now();
+    if(!lib)
+    {
+        fprintf(stderr, "loadBench error: dlopen failed: %s\n", dlerror());
+        exit(-1);
+    }
+    r->open_us = (t1 - t0) / 1e3;
+    r->map_us = r->reloc_us = -1; //no way to tell from outside
+
+    int n = c->nsyms * 2;
+    volatile void *sink;
+    t0 = now();
+    for(int round = 0; round < LOOKUP_ROUNDS; round++)
+        for(int i = 0; i < n; i++)
+            sink = dlsym(lib, c->names[i]);
+    t1 = now();
+    r->lookup_ns = (t1 - t0) / ((double)LOOKUP_ROUNDS * n);
+    r->batch_lookup_ns = -1;
+
+    timePLT(c, dlsym(lib, "call_all"), r);
+    r->rss_kb = rssKb() - rss0;
+}
+
+static void printNumber(const char *key, double val)
+{
+    //JSON has no NaN, a phase we can't measure is null
+    if(val < 0)
+        printf(", \"%s\": null", key);
+    else
+        printf(", \"%s\": %.3f", key, val);
+}
+
+static void runOne(struct benchCase *c, const char *loader, int mode)
+{
+    //a fresh process each time, so nothing is shared, warmed up or already resident
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "loadBench error: cannot fork\n");
+        exit(-1);
+    }
+    if(pid > 0)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "loadBench error: %s %s on %s did not finish\n",
+                loader, (mode & LAZY_BIND) ? "lazy" : "now", c->name);
+        return;
+    }
+
+    struct result r;
+    if(strcmp(loader, "redl") == 0)
+        benchRedl(c, mode, &r);
+    else
+        benchGlibc(c, mode, &r);
+    printf("{\"case\": \"%s\", \"loader\": \"%s\", \"bind\": \"%s\", \"depth\": %d, \"symbols\": %d, \"plt\": %d",
+        c->name, loader, (mode & LAZY_BIND) ? "lazy" : "now", c->depth, c->nsyms, c->nplt);
+    printNumber("open_us", r.open_us);
+    printNumber("map_us", r.map_us);
+    printNumber("reloc_us", r.reloc_us);
+    printNumber("lookup_ns", r.lookup_ns);
+    printNumber("batch_lookup_ns", r.batch_lookup_ns);
+    printNumber("plt_first_ns", r.plt_first_ns);
+    printNumber("plt_steady_ns", r.plt_steady_ns);
+    printf(", \"rss_kb\": %ld}\n", r.rss_kb);
+    fflush(stdout);
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 6)
+    {
+        fprintf(stderr, "usage: %s <dir> <name> <depth> <symbols> <plt>\n", argv[0]);
+        return -1;
+    }
+    struct benchCase c;
+    c.name = argv[2];
+    c.depth = atoi(argv[3]);
+    c.nsyms = atoi(argv[4]);
+    c.nplt = atoi(argv[5]);
+    snprintf(c.path, sizeof(c.path), "%s/lib%s0.so", argv[1], c.name);
+    if(c.nplt < 1 || c.depth < 2)
+    {
+        fprintf(stderr, "loadBench error: need a dependency and a PLT to measure\n");
+        return -1;
+    }
+
+    //half hits, half misses, in a fixed shuffled order so lookups don't walk the table in order
+    int n = c.nsyms * 2;
+    c.names = malloc(n * sizeof(char *));
+    for(int i = 0; i < n; i++)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), i < c.nsyms ? "l0_s%d" : "l0_missing%d", i % c.nsyms);
+        c.names[i] = strdup(buf);
+    }
+    srand(1);
+    for(int i = n - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        char *tmp = c.names[i];
+        c.names[i] = c.names[j];
+        c.names[j] = tmp;
+    }
+
+    runOne(&c, "redl", BIND_NOW);
+    runOne(&c, "redl", LAZY_BIND);
+    runOne(&c, "glibc", BIND_NOW);
+    runOne(&c, "glibc", LAZY_BIND);
+    return 0;
+}
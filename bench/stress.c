@@ -0,0 +1,97 @@
+//hammer openLibrary, closeLibrary and the first PLT calls from many threads at once
+//usage: stress <dir> <name> <depth> <plt> [threads] [rounds]
+//every round, all threads open the head of a genlib chain and one more library of it, lazily bound,
+//then race through call_all, which binds every PLT slot of the head in runtimeResolve, and close both
+#include "../dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_ROUNDS 20
+
+struct stressCase
+{
+    const char *dir, *name;
+    int depth, nplt;
+    int expected; //what call_all(1) returns
+    pthread_barrier_t start, opened;
+};
+
+struct stressThread
+{
+    struct stressCase *c;
+    int index, round;
+    int failed;
+};
+
+static void *stressWorker(void *arg)
+{
+    struct stressThread *t = arg;
+    struct stressCase *c = t->c;
+    char head[4096], other[4096];
+    snprintf(head, sizeof(head), "%s/lib%s0.so", c->dir, c->name);
+    snprintf(other, sizeof(other), "%s/lib%s%d.so", c->dir, c->name, (t->index + t->round) % c->depth);
+
+    pthread_barrier_wait(&c->start);
+    //half go for the head first, the others for a dependency it's about to map or has mapped
+    void *a = openLibrary(t->index & 1 ? other : head, LAZY_BIND, NULL);
+    void *b = openLibrary(t->index & 1 ? head : other, LAZY_BIND, NULL);
+    void *lib = t->index & 1 ? b : a;
+    pthread_barrier_wait(&c->opened);
+
+    int (*call_all)(int) = findSymbol(lib, "call_all");
+    if(!call_all || call_all(1) != c->expected || call_all(1) != c->expected)
+        t->failed = 1;
+    closeLibrary(a);
+    closeLibrary(b);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 5)
+    {
+        fprintf(stderr, "usage: %s <dir> <name> <depth> <plt> [threads] [rounds]\n", argv[0]);
+        return 1;
+    }
+    struct stressCase c = {argv[1], argv[2], atoi(argv[3]), atoi(argv[4])};
+    int nthreads = argc > 5 ? atoi(argv[5]) : DEFAULT_THREADS;
+    int rounds = argc > 6 ? atoi(argv[6]) : DEFAULT_ROUNDS;
+    if(c.depth < 2 || c.nplt < 1 || nthreads < 1 || rounds < 1)
+    {
+        fprintf(stderr, "stress error: depth must be at least 2, plt, threads and rounds at least 1\n");
+        return 1;
+    }
+    //slot k of the head calls l1_f<k>, which adds k
+    c.expected = 1 + c.nplt * (c.nplt - 1) / 2;
+
+    pthread_t workers[nthreads];
+    struct stressThread threads[nthreads];
+    int failures = 0;
+    for(int round = 0; round < rounds; round++)
+    {
+        pthread_barrier_init(&c.start, NULL, nthreads);
+        pthread_barrier_init(&c.opened, NULL, nthreads);
+        for(int i = 0; i < nthreads; i++)
+        {
+            threads[i] = (struct stressThread){&c, i, round, 0};
+            if(pthread_create(&workers[i], NULL, stressWorker, &threads[i]) != 0)
+            {
+                fprintf(stderr, "stress error: cannot start thread %d\n", i);
+                return 1;
+            }
+        }
+        for(int i = 0; i < nthreads; i++)
+        {
+            pthread_join(workers[i], NULL);
+            failures += threads[i].failed;
+        }
+        pthread_barrier_destroy(&c.start);
+        pthread_barrier_destroy(&c.opened);
+    }
+    printf("{\"case\": \"%s\", \"threads\": %d, \"rounds\": %d, \"failures\": %d}\n", c.name, nthreads, rounds,
+        failures);
+    return failures != 0;
+}
@@ -0,0 +1,74 @@
+//where IMAGE_CACHE and page profiles keep their files, and how they're opened.
+//what's read from there is mapped over GOTs, so a file somebody else could have planted must never be
+//used: the directory is per user ($DL_REBUILD_CACHE, else $XDG_CACHE_HOME/dl-rebuild, else
+//~/.cache/dl-rebuild), and the directory and every file in it must be ours and writable by nobody else
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static int isTrusted(int fd, uid_t owner, int dir)
+{
+    //ours (or `owner`'s), a real directory or regular file, and not group or world writable
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+        return 0;
+    if(dir ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode))
+        return 0;
+    return (st.st_uid == getuid() || st.st_uid == owner) && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+int cacheDirectory(char *dir, size_t len)
+{
+    //the cache directory, created if needed, -1 if there's none we can trust
+    const char *env = getenv("DL_REBUILD_CACHE");
+    int n;
+    if(env)
+        n = snprintf(dir, len, "%s", env);
+    else if((env = getenv("XDG_CACHE_HOME")) && env[0] == '/')
+        n = snprintf(dir, len, "%s/dl-rebuild", env);
+    else if((env = getenv("HOME")) && env[0] == '/')
+    {
+        n = snprintf(dir, len, "%s/.cache", env);
+        if(n > 0 && (size_t)n < len)
+            mkdir(dir, 0700); //fine if it's already there
+        n = snprintf(dir, len, "%s/.cache/dl-rebuild", env);
+    }
+    else
+        return -1;
+    if(n < 0 || (size_t)n >= len)
+        return -1;
+    mkdir(dir, 0700); //fine if it's already there
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if(fd < 0)
+        return -1;
+    int ok = isTrusted(fd, getuid(), 1);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+FILE *openCacheFile(const char *path, uid_t owner)
+{
+    //open a cache file for reading, NULL if it's missing or not trusted. `owner` may own it besides us
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if(fd < 0)
+        return NULL;
+    if(!isTrusted(fd, owner, 0))
+    {
+        close(fd);
+        return NULL;
+    }
+    FILE *f = fdopen(fd, "rb");
+    if(!f)
+        close(fd);
+    return f;
+}
+
+int createCacheFile(const char *path, mode_t mode)
+{
+    //a fresh file to write and rename into place, never one that's there already
+    return open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, mode);
+}
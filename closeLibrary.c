@@ -0,0 +1,145 @@
+// the other half of openLibrary: drop a reference, and unload whatever nobody needs any more.
+// a DT_NEEDED cycle keeps its own members referenced forever, so after every close collectCycles looks for
+// libraries only other such libraries hold
+
+#include "library.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+extern void unregisterLibrary(Library *lib);
+extern void lockRegistry(void);
+extern void unlockRegistry(void);
+extern void releaseRange(uint64_t start, uint64_t len);
+extern void fakeRelease(Library *lib);
+extern void scopeIndexRelease(Library *lib);
+extern void pltProfileRelease(Library *lib);
+extern void instancePlanRelease(Library *lib);
+extern void tlsRelease(Library *lib);
+extern void asyncClose(Library *handle);
+extern void addressIndexRemove(Library *lib);
+extern void lazyRelease(Library *lib);
+extern Library *loadedLibraries;
+
+static void dropReference(Library *lib);
+
+static void unloadLibrary(Library *lib)
+{
+    //forget lib first, nobody may find it half gone
+    unregisterLibrary(lib);
+    TRACE_REPORT(lib, "close"); //lookups and lazy binds of its whole life
+    scopeIndexRelease(lib);
+    pltProfileRelease(lib);
+    instancePlanRelease(lib);
+    tlsRelease(lib);
+    lazyRelease(lib);
+    if(lib->search_list)
+        for(Library **dep = lib->search_list + 1; *dep; dep++)
+            dropReference(*dep);
+
+    if(lib->fake)
+        fakeRelease(lib); //the one dlclose of a fake object
+    if(lib->maplength)
+    {
+        addressIndexRemove(lib);
+        releaseRange(lib->addr, lib->maplength);
+    }
+    if(lib->fs)
+        fclose(lib->fs);
+    free(lib->search_list);
+    free(lib->phdr);
+    free(lib->segs);
+    free(lib->trace);
+    free(lib->name);
+    pthread_mutex_destroy(&lib->reloc_lock);
+    free(lib);
+}
+
+static void dropReference(Library *lib)
+{
+    if(--lib->refcount == 0)
+        unloadLibrary(lib);
+}
+
+static Library *nextDep(Library **dep)
+{
+    //LAZY_LOAD fills search_list slots without the registry, see lazyLoadSymbol
+    return __atomic_load_n(dep, __ATOMIC_ACQUIRE);
+}
+
+static void collectCycles(void)
+{
+    //call with the registry held. a library is in use if it has more references than search_lists point at it,
+    //an open handle or a load in progress, or if such a library reaches it. the rest is cycles nobody can reach
+    int n = 0;
+    for(Library *lib = loadedLibraries; lib; lib = lib->loaded_next)
+    {
+        lib->gc_refs = 0;
+        n++;
+    }
+    for(Library *lib = loadedLibraries; lib; lib = lib->loaded_next)
+        for(Library **dep = lib->search_list ? lib->search_list + 1 : NULL; dep && nextDep(dep); dep++)
+            nextDep(dep)->gc_refs++;
+
+    Library **stack = malloc((n + 1) * sizeof(Library *));
+    int top = 0;
+    for(Library *lib = loadedLibraries; lib; lib = lib->loaded_next)
+    {
+        if(lib->refcount > lib->gc_refs)
+        {
+            lib->gc_refs = -1; //in use
+            stack[top++] = lib;
+        }
+    }
+    while(top)
+    {
+        Library *lib = stack[--top];
+        for(Library **dep = lib->search_list ? lib->search_list + 1 : NULL; dep && nextDep(dep); dep++)
+        {
+            if(nextDep(dep)->gc_refs != -1)
+            {
+                nextDep(dep)->gc_refs = -1;
+                stack[top++] = nextDep(dep);
+            }
+        }
+    }
+
+    int ngarbage = 0;
+    for(Library *lib = loadedLibraries; lib; lib = lib->loaded_next)
+        if(lib->gc_refs != -1)
+            stack[ngarbage++] = lib;
+    //take the references they hold on each other out of search_list, then each is down to zero and unloading
+    //it only drops what it holds on libraries still in use
+    for(int i = 0; i < ngarbage; i++)
+    {
+        if(!stack[i]->search_list)
+            continue;
+        Library **kept = stack[i]->search_list + 1;
+        for(Library **dep = kept; *dep; dep++)
+        {
+            if((*dep)->gc_refs == -1)
+                *kept++ = *dep;
+            else
+                (*dep)->refcount--;
+        }
+        *kept = NULL;
+    }
+    for(int i = 0; i < ngarbage; i++)
+        unloadLibrary(stack[i]);
+    free(stack);
+}
+
+void closeLibrary(void *library)
+{
+    if(!library)
+        return;
+    if(((Library *)library)->async)
+    {
+        asyncClose(library); //a handle of openLibraryAsync
+        return;
+    }
+    lockRegistry();
+    dropReference(library);
+    collectCycles();
+    unlockRegistry();
+}
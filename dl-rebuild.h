@@ -1,6 +1,125 @@
 //interface for the users
+#ifndef DL_REBUILD_H
+#define DL_REBUILD_H
+
+#include <stdio.h> //for FILE
+
 #define BIND_NOW 0
 #define LAZY_BIND 1
+#define SCOPE_INDEX 2 //resolve imports through one merged table of the whole chain
+//reuse relocated segments saved by an earlier process, see imageCache.c. Directory is $DL_REBUILD_CACHE,
+//else $XDG_CACHE_HOME/dl-rebuild or ~/.cache/dl-rebuild, it and its files must be ours and writable only by us
+#define IMAGE_CACHE 4
+#define PIPELINED_MAP 8 //open and read the headers of dependencies on background threads
+//start executable segments on 2 MiB boundaries (or p_align if larger) and back them with THP
+//libraries are moved up as needed, so the address passed to openLibrary becomes a lower bound
+#define HUGE_TEXT 16
+//count calls through every PLT slot of the library, see pltProfileReport. PLT_PROFILE_CYCLES also times
+//one call in 1024 by hijacking its return address, so keep it away from code that unwinds through those calls
+#define PLT_PROFILE 32
+#define PLT_PROFILE_CYCLES (PLT_PROFILE | 64)
+//write per library phase timings and counters as JSON lines, like $DL_REBUILD_TRACE does for every open
+//only in a libredl built with `make TRACE=1`, see trace.c
+#define TRACE_LOAD 128
+//relocate with n threads (1..255), e.g. LAZY_BIND | RELOC_THREADS(8); 0 or 1 means serial
+#define RELOC_THREADS(n) (((n) & 0xff) << 8)
+#define RELOC_THREAD_NUM(mode) (((mode) >> 8) & 0xff)
+//fault in the pages recorded by pageProfileSave in an earlier run right after mapping, all at once
+#define PAGE_PROFILE 65536
+//findSymbol on a handle of openLibraryAsync that is still loading returns NULL instead of waiting
+#define ASYNC_FAIL_FAST 131072
+//map a DT_NEEDED dependency nothing has loaded yet only when an import isn't found in what is loaded
+//(Solaris -z lazyload). Pair it with LAZY_BIND, so calls load them on first use rather than relocation.
+//a deferred dependency loaded while relocating may need the library deferring it back, that one is then
+//finished after it, so an IFUNC resolver of the dependency must not call into it
+#define LAZY_LOAD 262144
 
 extern void* openLibrary(const char *name, int mode, void *addr);
+//open a library that has no path: `len` bytes of ELF image at `buf`, or a file range starting at `offset`
+//of the open file `fd` (a memfd, a packed artifact). `name` is what dependencies and isLibraryOpen know it by.
+//a page aligned offset is mapped straight from fd, anything else is copied into a memfd first.
+//buf and fd stay the caller's, they can go away once these return
+extern void *openLibraryFromMemory(const void *buf, unsigned long len, const char *name, int mode, void *addr);
+extern void *openLibraryFromFd(int fd, unsigned long offset, const char *name, int mode, void *addr);
+//where a library comes from, fill in either buf and len, or fd and offset (fd is -1 when not used).
+//len 0 with an fd means up to the end of the file
+struct libraryImage
+{
+    const void *buf;
+    unsigned long len;
+    int fd;
+    unsigned long offset;
+};
+//asked first for every dependency, return 1 with `image` filled in, or 0 to search the usual paths.
+//with PIPELINED_MAP it's called from the background threads
+typedef int (*libraryResolver)(const char *name, void *arg, struct libraryImage *image);
+extern void setLibraryResolver(libraryResolver resolver, void *arg);
+//openLibrary on a background thread, the handle comes back at once. Every call taking a library takes the
+//handle too and waits for the load first (findSymbol and findSymbols give NULL instead with ASYNC_FAIL_FAST).
+//`callback`, if any, runs on the background thread with the library, before waitLibrary returns it elsewhere.
+//a few loads run side by side; waitLibrary in a callback is fine, on its own handle it returns at once and a
+//load still queued is done right there, but waiting on each other's loads from two callbacks deadlocks
+typedef void (*libraryCallback)(void *library, void *arg);
+extern void *openLibraryAsync(const char *name, int mode, void *addr, libraryCallback callback, void *arg);
+extern int libraryReady(void *handle); //1 once the load is done
+extern void *waitLibrary(void *handle);
 extern void* findSymbol(void *library, const char *symname);
+//look up `count` names at once, out[i] is what findSymbol(library, names[i]) would give, NULL included
+//much faster than a loop of findSymbol when there are many names, their cache misses overlap
+extern void findSymbols(void *library, const char **names, unsigned long count, void **out);
+//drop one reference taken by openLibrary, libraries nobody needs any more are unmapped
+//with addr == NULL, openLibrary places each library itself and reuses ranges freed here
+extern void closeLibrary(void *library);
+//map `count` more instances of an opened library, at addrs[i], or wherever fits if addrs or addrs[i] is NULL.
+//they share its dependencies, and the imports it resolved are replayed rather than looked up again,
+//so an instance costs its mmaps and relocations. Every instance is closed with closeLibrary
+extern void openInstances(void *library, int mode, int count, void **addrs, void **instances);
+//how many 2 MiB pages back the library right now, see HUGE_TEXT
+extern long hugePageCount(void *library);
+//what addressToSymbol knows about an address, the names are good while the library stays open
+struct symbolInfo
+{
+    void *library;
+    const char *library_name;
+    void *base; //load address
+    const char *symbol; //the function containing the address, NULL if none does
+    void *start;
+    unsigned long size;
+};
+//dladdr for the libraries we mapped, 0 if the address isn't in any of them. Takes no lock and
+//allocates nothing, except the first time an address falls into a library
+extern int addressToSymbol(const void *addr, struct symbolInfo *info);
+//record which pages of the library and its dependencies this process has touched so far, call it once
+//warmed up. One profile per file, next to it as <file>.pages, or in the IMAGE_CACHE directory. 0 on success
+extern int pageProfileSave(void *library);
+//memory one segment of a library takes right now, pages are getpagesize() ones
+struct segmentUsage
+{
+    void *start;
+    unsigned long mapped; //bytes
+    int prot; //PROT_* bits
+    unsigned long resident; //pages in memory
+    unsigned long dirty; //private pages: copied on write, .bss, or swapped out
+    unsigned long reloc_dirty; //the dirty pages that hold relocation targets, prelinking would share those
+    unsigned long program_dirty; //the dirty pages that don't, written by the program itself
+};
+//fill in up to `max` segments of the library, returns how many, or -1 without /proc/self/pagemap
+extern int memoryUsage(void *library, struct segmentUsage *usage, int max);
+//print memoryUsage of the library and every dependency, with a total per library
+extern void memoryReport(void *library, FILE *out);
+//print calls (and sampled cycles) per PLT slot, hottest first
+extern void pltProfileReport(void *library, FILE *out);
+//0 puts the real targets back into the GOT so calls cost nothing again, 1 resumes counting
+extern void pltProfileSwitch(void *library, int on);
+
+//counters of the dlopen/dlsym fallback used by fake loaded objects like libc
+struct fakeLoadStats
+{
+    unsigned long fake_objects;
+    unsigned long dlopen_calls; //should equal fake_objects
+    unsigned long dlsym_calls;
+    unsigned long memo_hits;
+};
+extern void fakeLoadStats(void *library, struct fakeLoadStats *stats);
+
+#endif
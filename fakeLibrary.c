@@ -0,0 +1,150 @@
+//symbol lookup for fake loaded objects, which are really opened by dlopen and searched by dlsym
+//almost every import ends up in libc, so keep one handle per Library and remember what dlsym said
+#include "library.h"
+#include "dl-rebuild.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+struct fakeMemo
+{
+    char *name; //NULL means an empty slot, set last so readers never see half an entry
+    uint32_t hash;
+    void *addr; //NULL is a remembered miss, those are as common as hits
+};
+
+//lazy binding reads the memo without a lock: a published table only ever gets empty slots filled,
+//and a table replaced by a bigger one stays around until fakeRelease, for readers still in it
+struct fakeMemoTable
+{
+    uint32_t mask, used;
+    struct fakeMemoTable *retired;
+    struct fakeMemo slots[];
+};
+
+extern int scopeOrder(Library *head, Library ***order);
+extern Library *libraryOf(void *library);
+
+static struct fakeMemo *memoProbe(struct fakeMemoTable *t, const char *name, uint32_t hash)
+{
+    uint32_t i = hash & t->mask;
+    while (1)
+    {
+        struct fakeMemo *m = &t->slots[i];
+        const char *mname = __atomic_load_n(&m->name, __ATOMIC_ACQUIRE);
+        if (!mname)
+            return m;
+        if (m->hash == hash && strcmp(mname, name) == 0)
+            return m;
+        i = (i + 1) & t->mask;
+    }
+}
+
+static void memoGrow(Library *lib)
+{
+    //start small, double when half full. Call with fakeLock held
+    struct fakeMemoTable *old = lib->fake_memo;
+    uint32_t oldcap = old ? old->mask + 1 : 0;
+    if (oldcap && (old->used + 1) * 2 <= oldcap)
+        return;
+    uint32_t cap = oldcap ? oldcap * 2 : 64;
+    struct fakeMemoTable *t = calloc(1, sizeof(struct fakeMemoTable) + cap * sizeof(struct fakeMemo));
+    t->mask = cap - 1;
+    t->used = old ? old->used : 0;
+    t->retired = old;
+    for (uint32_t i = 0; i < oldcap; i++)
+        if (old->slots[i].name)
+            *memoProbe(t, old->slots[i].name, old->slots[i].hash) = old->slots[i];
+    __atomic_store_n(&lib->fake_memo, t, __ATOMIC_RELEASE); //fully built before anyone sees it
+}
+
+//only misses take it, dlsym is slow enough that one lock doesn't matter
+static pthread_mutex_t fakeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fakeOpen(Library *lib)
+{
+    //the only dlopen this Library will ever do, call with fakeLock held
+    if (lib->fake_handle)
+        return;
+    lib->fake_handle = dlopen(lib->name, RTLD_LAZY);
+    lib->fake_dlopen_calls++;
+    if (!lib->fake_handle)
+    {
+        fprintf(stderr, "relocLibrary error: cannot dlopen a fake object named %s", lib->name);
+        exit(-1);
+    }
+}
+
+void *fakeLookup(Library *lib, const char *name)
+{
+    uint32_t hash = dl_new_hash(name);
+    struct fakeMemoTable *t = __atomic_load_n(&lib->fake_memo, __ATOMIC_ACQUIRE);
+    if (t)
+    {
+        struct fakeMemo *m = memoProbe(t, name, hash);
+        if (m->name)
+        {
+            __atomic_fetch_add(&lib->fake_memo_hits, 1, __ATOMIC_RELAXED);
+            return m->addr;
+        }
+    }
+
+    pthread_mutex_lock(&fakeLock);
+    fakeOpen(lib);
+    memoGrow(lib);
+    struct fakeMemo *m = memoProbe(lib->fake_memo, name, hash);
+    if (m->name)
+        __atomic_fetch_add(&lib->fake_memo_hits, 1, __ATOMIC_RELAXED); //another thread just asked
+    else
+    {
+        m->addr = dlsym(lib->fake_handle, name);
+        lib->fake_dlsym_calls++;
+        m->hash = hash;
+        //the importer's strtab may go away before we do
+        __atomic_store_n(&m->name, strdup(name), __ATOMIC_RELEASE);
+        lib->fake_memo->used++;
+    }
+    void *addr = m->addr;
+    pthread_mutex_unlock(&fakeLock);
+    return addr;
+}
+
+void fakeRelease(Library *lib)
+{
+    //drop the handle with a single dlclose, and forget everything dlsym told us
+    if (lib->fake_handle)
+        dlclose(lib->fake_handle);
+    lib->fake_handle = NULL;
+    struct fakeMemoTable *t = lib->fake_memo;
+    if (t)
+        for (uint32_t i = 0; i <= t->mask; i++)
+            free(t->slots[i].name); //older tables share the same names
+    while (t)
+    {
+        struct fakeMemoTable *retired = t->retired;
+        free(t);
+        t = retired;
+    }
+    lib->fake_memo = NULL;
+}
+
+void fakeLoadStats(void *library, struct fakeLoadStats *stats)
+{
+    //sum the counters of every fake object in the scope of `library`
+    memset(stats, 0, sizeof(struct fakeLoadStats));
+    Library **order;
+    int n = scopeOrder(libraryOf(library), &order);
+    for (int i = 0; i < n; i++)
+    {
+        Library *lib = order[i];
+        if (!lib->fake)
+            continue;
+        stats->fake_objects++;
+        stats->dlopen_calls += lib->fake_dlopen_calls;
+        stats->dlsym_calls += lib->fake_dlsym_calls;
+        stats->memo_hits += lib->fake_memo_hits;
+    }
+    free(order);
+}
@@ -1,27 +1,247 @@
 //find the address of a symbol
 #include "library.h"
+#include "trace.h"
 #include <elf.h>
 #include <stdlib.h>
 #include <string.h>
+#include <link.h> //for __ELF_NATIVE_CLASS
+
+extern void *symbolLookup(Library *dep, const char *name);
+extern void *tlsSymbolAddress(Library *lib, const Elf64_Sym *sym);
+extern Library *asyncTarget(Library *handle);
+
+//borrowed from dl-lookup.c:check_match, only the part we care about
+int symbolExported(const Elf64_Sym *sym)
+{
+    //undefined symbols are imports of this object, not definitions
+    if(sym->st_shndx == SHN_UNDEF)
+        return 0;
+    if(sym->st_value == 0 && ELF64_ST_TYPE(sym->st_info) != STT_TLS)
+        return 0;
+    //only code and data, no section or file symbols
+    #define ALLOWED_STT \
+        ((1 << STT_NOTYPE) | (1 << STT_OBJECT) | (1 << STT_FUNC) \
+        | (1 << STT_COMMON) | (1 << STT_TLS) | (1 << STT_GNU_IFUNC))
+    if(((1 << ELF64_ST_TYPE(sym->st_info)) & ALLOWED_STT) == 0)
+        return 0;
+    //local symbols like "tmp" must never be seen from outside
+    switch (ELF64_ST_BIND(sym->st_info))
+    {
+    case STB_GLOBAL:
+    case STB_WEAK:
+    case STB_GNU_UNIQUE:
+        break;
+    default:
+        return 0;
+    }
+    switch (ELF64_ST_VISIBILITY(sym->st_other))
+    {
+    case STV_HIDDEN:
+    case STV_INTERNAL:
+        return 0;
+    default:
+        break;
+    }
+    return 1;
+}
+
+static inline int checkMatch(const Elf64_Sym *sym, const char *strtab, const char *name)
+{
+    return symbolExported(sym) && strcmp(strtab + sym->st_name, name) == 0;
+}
+
+uint32_t symbolCount(Library *lib)
+{
+    //neither hash table records it directly for GNU hash, so find the end of the last chain
+    if (lib->l_nbuckets == 0)
+        return 0;
+    if (!lib->l_gnu_bitmask)
+        return lib->l_buckets[-1]; //nchain sits right before the buckets
+    Elf32_Word last = 0;
+    for (uint32_t i = 0; i < lib->l_nbuckets; i++)
+        if (lib->l_gnu_buckets[i] > last)
+            last = lib->l_gnu_buckets[i];
+    if (last == 0)
+        return 0;
+    while ((lib->l_gnu_chain_zero[last] & 1u) == 0)
+        last++;
+    return last + 1;
+}
+
+static Elf64_Sym *gnuLookup(Library *lib, const char *name)
+{
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+
+    uint_fast32_t new_hash = dl_new_hash(name);
+    const Elf64_Addr *bitmask = lib->l_gnu_bitmask;
+    TRACE_COUNT(lib, TRACE_LOOKUPS, 1);
+    Elf64_Addr bitmask_word = bitmask[(new_hash / __ELF_NATIVE_CLASS) & lib->l_gnu_bitmask_idxbits];
+    unsigned int hashbit1 = new_hash & (__ELF_NATIVE_CLASS - 1);
+    unsigned int hashbit2 = ((new_hash >> lib->l_gnu_shift) & (__ELF_NATIVE_CLASS - 1));
+    //bloom filter says no, so it's definitely not here
+    if (((bitmask_word >> hashbit1) & (bitmask_word >> hashbit2) & 1) == 0)
+    {
+        TRACE_COUNT(lib, TRACE_BLOOM_REJECTS, 1);
+        return NULL;
+    }
+
+    Elf32_Word bucket = lib->l_gnu_buckets[new_hash % lib->l_nbuckets];
+    if (bucket == 0)
+        return NULL;
+    const Elf32_Word *hasharr = &lib->l_gnu_chain_zero[bucket];
+    do
+    {
+        TRACE_COUNT(lib, TRACE_CHAIN_STEPS, 1);
+        //the lowest bit marks the end of chain, so compare the rest
+        if (((*hasharr ^ new_hash) >> 1) == 0)
+        {
+            Elf64_Sym *sym = &symtab[hasharr - lib->l_gnu_chain_zero];
+            if (checkMatch(sym, strtab, name))
+                return sym;
+        }
+    } while ((*hasharr++ & 1u) == 0);
+    return NULL;
+}
+
+static Elf64_Sym *sysvLookup(Library *lib, const char *name)
+{
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+
+    unsigned long hash = dl_elf_hash(name);
+    TRACE_COUNT(lib, TRACE_LOOKUPS, 1);
+    for (Elf32_Word symidx = lib->l_buckets[hash % lib->l_nbuckets];
+        symidx != STN_UNDEF; symidx = lib->l_chain[symidx])
+    {
+        TRACE_COUNT(lib, TRACE_CHAIN_STEPS, 1);
+        if (checkMatch(&symtab[symidx], strtab, name))
+            return &symtab[symidx];
+    }
+    return NULL;
+}
+
+Elf64_Sym *hashLookup(Library *lib, const char *name)
+{
+    //find symbol `name` defined by `lib` itself, prefer GNU hash like ld.so does
+    if (lib->l_nbuckets == 0)
+        return NULL; //no hash table at all, nothing can be found
+    if (lib->l_gnu_bitmask)
+        return gnuLookup(lib, name);
+    return sysvLookup(lib, name);
+}
 
 void *findSymbol(void *library, const char *symname)
 {
+    //fake objects are searched by dlsym, the others go through the hash table
     Library *lib = library;
-    Elf64_Sym *symtab = (void *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
-    const char *strtab = (void *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
-    
-    Elf64_Sym *curr = symtab;
-    //TODO: plz utilize the hash table... this is dumb
-    //this works because strtab and symtab are adjacent
-    while((void *)curr < (void *)strtab)
-    {
-        Elf64_Word name = curr->st_name;
-        if(strcmp(symname, strtab + name) == 0)
+    if(lib->async && !(lib = asyncTarget(lib)))
+        return NULL; //still loading, and we were asked not to wait
+    return symbolLookup(lib, symname);
+}
+
+//findSymbols works on groups of names: every bloom word, bucket, chain and candidate name of a group
+//is prefetched one stage ahead of being read, so their cache misses overlap instead of queueing
+#define BATCH 16
+
+static void gnuLookupBatch(Library *lib, const char **names, int n, void **out)
+{
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+    const Elf64_Addr *bitmask = lib->l_gnu_bitmask;
+    uint32_t hashes[BATCH];
+    const Elf32_Word *chain[BATCH]; //NULL once the name is known to be missing
+    TRACE_COUNT(lib, TRACE_LOOKUPS, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        hashes[i] = dl_new_hash(names[i]);
+        __builtin_prefetch(&bitmask[(hashes[i] / __ELF_NATIVE_CLASS) & lib->l_gnu_bitmask_idxbits]);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        //same bloom filter test as gnuLookup
+        uint32_t hash = hashes[i];
+        Elf64_Addr bitmask_word = bitmask[(hash / __ELF_NATIVE_CLASS) & lib->l_gnu_bitmask_idxbits];
+        unsigned int hashbit1 = hash & (__ELF_NATIVE_CLASS - 1);
+        unsigned int hashbit2 = ((hash >> lib->l_gnu_shift) & (__ELF_NATIVE_CLASS - 1));
+        chain[i] = ((bitmask_word >> hashbit1) & (bitmask_word >> hashbit2) & 1) ? lib->l_gnu_chain_zero : NULL;
+        if (chain[i])
+            __builtin_prefetch(&lib->l_gnu_buckets[hash % lib->l_nbuckets]);
+        else
+            TRACE_COUNT(lib, TRACE_BLOOM_REJECTS, 1);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (!chain[i])
+            continue;
+        Elf32_Word bucket = lib->l_gnu_buckets[hashes[i] % lib->l_nbuckets];
+        chain[i] = bucket ? &lib->l_gnu_chain_zero[bucket] : NULL;
+        if (chain[i])
+            __builtin_prefetch(chain[i]);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        //move to the first entry whose hash matches, and fetch its symbol and name
+        const Elf32_Word *hasharr = chain[i];
+        if (!hasharr)
+            continue;
+        while (((*hasharr ^ hashes[i]) >> 1) != 0)
         {
-            //we have a match
-            return (void *)(curr->st_value + lib->addr);
+            TRACE_COUNT(lib, TRACE_CHAIN_STEPS, 1);
+            if (*hasharr++ & 1u)
+            {
+                hasharr = NULL; //end of chain
+                break;
+            }
+        }
+        chain[i] = hasharr;
+        if (hasharr)
+        {
+            Elf64_Sym *sym = &symtab[hasharr - lib->l_gnu_chain_zero];
+            __builtin_prefetch(sym);
+            __builtin_prefetch(strtab + sym->st_name);
         }
-        ++curr;
     }
-    return NULL;
+    for (int i = 0; i < n; i++)
+    {
+        //from here on it's the tail of gnuLookup
+        out[i] = NULL;
+        const Elf32_Word *hasharr = chain[i];
+        if (!hasharr)
+            continue;
+        do
+        {
+            TRACE_COUNT(lib, TRACE_CHAIN_STEPS, 1);
+            if (((*hasharr ^ hashes[i]) >> 1) == 0)
+            {
+                Elf64_Sym *sym = &symtab[hasharr - lib->l_gnu_chain_zero];
+                if (checkMatch(sym, strtab, names[i]))
+                {
+                    out[i] = ELF64_ST_TYPE(sym->st_info) == STT_TLS ? tlsSymbolAddress(lib, sym)
+                        : (void *)(sym->st_value + lib->addr);
+                    break;
+                }
+            }
+        } while ((*hasharr++ & 1u) == 0);
+    }
+}
+
+void findSymbols(void *library, const char **names, unsigned long count, void **out)
+{
+    Library *lib = library;
+    if (lib->async && !(lib = asyncTarget(lib)))
+    {
+        memset(out, 0, count * sizeof(void *));
+        return;
+    }
+    if (lib->fake || !lib->l_gnu_bitmask)
+    {
+        //dlsym or the SysV table, nothing to overlap there
+        for (unsigned long i = 0; i < count; i++)
+            out[i] = findSymbol(lib, names[i]);
+        return;
+    }
+    for (unsigned long i = 0; i < count; i += BATCH)
+        gnuLookupBatch(lib, names + i, count - i < BATCH ? count - i : BATCH, out + i);
 }
\ No newline at end of file
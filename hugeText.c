@@ -0,0 +1,84 @@
+//put executable segments on 2 MiB boundaries and back them with transparent huge pages
+//a big .text spread over 4 KiB pages costs lots of iTLB misses, see HUGE_TEXT
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2ul << 20)
+#define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
+#define ALIGN_UP(base, size) ALIGN_DOWN((base) + (size)-1, (size))
+
+extern Library *libraryOf(void *library);
+
+uint64_t textAlignment(Elf64_Phdr *phdr, uint16_t phnum, uint64_t *text_offset)
+{
+    //how the load address must be aligned so the first executable PT_LOAD starts on a huge page
+    //text_offset is where that segment starts relative to the load address, 0 means nothing to align
+    int pagesize = getpagesize();
+    for(Elf64_Phdr *ph = phdr; ph < &phdr[phnum]; ph++)
+    {
+        if(ph->p_type != PT_LOAD || !(ph->p_flags & PF_X))
+            continue;
+        *text_offset = ALIGN_DOWN(ph->p_vaddr, pagesize);
+        return ph->p_align > HUGE_PAGE_SIZE ? ph->p_align : HUGE_PAGE_SIZE;
+    }
+    *text_offset = 0;
+    return 0;
+}
+
+void promoteText(Library *lib)
+{
+    //file backed text rarely gets huge pages, so copy every whole huge page of it
+    //into anonymous memory that asked for them, then make it executable again
+    for(int i = 0; i < lib->nsegs; i++)
+    {
+        struct segment *seg = &lib->segs[i];
+        if(!(seg->prot & PROT_EXEC) || !(seg->prot & PROT_READ))
+            continue;
+        uint64_t start = ALIGN_UP(seg->start, HUGE_PAGE_SIZE);
+        uint64_t end = ALIGN_DOWN(seg->end, HUGE_PAGE_SIZE);
+        if(end <= start)
+            continue; //less than one huge page, not worth it
+        uint64_t len = end - start;
+        void *copy = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(copy == MAP_FAILED)
+            continue;
+        memcpy(copy, (void *)start, len);
+        if(mmap((void *)start, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            fprintf(stderr, "mapLibrary error: cannot remap text of %s for huge pages\n", lib->name);
+            exit(-1);
+        }
+        madvise((void *)start, len, MADV_HUGEPAGE);
+        memcpy((void *)start, copy, len); //faults on the aligned range now come in 2 MiB
+        mprotect((void *)start, len, seg->prot);
+        munmap(copy, len);
+    }
+}
+
+long hugePageCount(void *library)
+{
+    //2 MiB pages backing the library right now, anonymous or file THP, from /proc/self/smaps
+    Library *lib = libraryOf(library);
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if(!smaps)
+        return -1;
+    char line[512];
+    int inside = 0;
+    long kb = 0;
+    while(fgets(line, sizeof(line), smaps))
+    {
+        uint64_t start, end;
+        long val;
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' '))
+            inside = start >= lib->addr && end <= lib->addr + lib->maplength;
+        else if(inside && (sscanf(line, "AnonHugePages: %ld kB", &val) == 1
+            || sscanf(line, "FilePmdMapped: %ld kB", &val) == 1))
+            kb += val;
+    }
+    fclose(smaps);
+    return kb / (HUGE_PAGE_SIZE >> 10);
+}
@@ -0,0 +1,371 @@
+//keep the relocated writable segments of a chain on disk, so the next process loading
+//the same files at the same address maps them back instead of relocating again, like prelink did.
+//imports from objects ld.so loaded for us can't be kept like that, ld.so puts them somewhere else every run,
+//so they are saved as fixups, the symbol and where it goes, and looked up again on every load
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
+#define ALIGN_UP(base, size) ALIGN_DOWN((base) + (size)-1, (size))
+
+#define CACHE_MAGIC 0x43524c44 //"DLRC"
+#define CACHE_VERSION 2
+#define BUILD_ID_MAX 20
+
+extern void relocInit(Library *lib, int mode);
+extern void *resolveSymbol(Library *lib, const char *name);
+extern int scopeOrder(Library *head, Library ***order);
+extern int cacheDirectory(char *dir, size_t len);
+extern FILE *openCacheFile(const char *path, uid_t owner);
+extern int createCacheFile(const char *path, mode_t mode);
+
+struct cacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nlibs;
+    uint32_t lazy; //GOT contents differ between lazy and bind-now
+    uint32_t nfixups;
+};
+
+//everything that must be the same for the saved pages to be valid
+struct cacheKey
+{
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint8_t build_id[BUILD_ID_MAX];
+    uint32_t fake;
+    uint64_t addr; //load address, 0 for a fake object, whose imports are fixups
+};
+
+struct cacheLib
+{
+    struct cacheKey key;
+    uint32_t relocated;
+    uint32_t nsegs; //writable segments saved for this library
+};
+
+struct cacheSeg
+{
+    uint64_t start, end;
+    uint64_t offset; //page aligned position of the contents in the cache file
+    int64_t prot;
+};
+
+//an import that resolved outside of what we mapped, redone on load: *(addr + offset) = symbol + addend
+struct cacheFixup
+{
+    uint32_t lib; //index in scope order
+    uint32_t name; //into the dynamic string table of that library
+    uint64_t offset;
+    int64_t addend;
+};
+
+static void readBuildId(Library *lib, uint8_t *build_id)
+{
+    //NT_GNU_BUILD_ID lives in a PT_NOTE, which is inside a mapped PT_LOAD
+    memset(build_id, 0, BUILD_ID_MAX);
+    for(Elf64_Phdr *ph = lib->phdr; ph < &lib->phdr[lib->phnum]; ph++)
+    {
+        if(ph->p_type != PT_NOTE)
+            continue;
+        char *note = (char *)(lib->addr + ph->p_vaddr);
+        char *end = note + ph->p_memsz;
+        while(note + sizeof(Elf64_Nhdr) <= end)
+        {
+            Elf64_Nhdr *nhdr = (Elf64_Nhdr *)note;
+            char *name = note + sizeof(Elf64_Nhdr);
+            char *desc = name + ALIGN_UP(nhdr->n_namesz, 4);
+            if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0)
+            {
+                memcpy(build_id, desc, nhdr->n_descsz < BUILD_ID_MAX ? nhdr->n_descsz : BUILD_ID_MAX);
+                return;
+            }
+            note = desc + ALIGN_UP(nhdr->n_descsz, 4);
+        }
+    }
+}
+
+static void makeKey(Library *lib, struct cacheKey *key)
+{
+    struct stat st;
+    memset(key, 0, sizeof(struct cacheKey));
+    fstat(fileno(lib->fs), &st);
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_sec = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    key->fake = lib->fake;
+    if(!lib->fake)
+    {
+        key->addr = lib->addr;
+        readBuildId(lib, key->build_id);
+    }
+}
+
+static int cachePath(Library *head, int mode, char *path, size_t len)
+{
+    char dir[4096];
+    struct stat st;
+    if(cacheDirectory(dir, sizeof(dir)) < 0 || fstat(fileno(head->fs), &st) < 0)
+        return -1;
+    int n = snprintf(path, len, "%s/%lx-%lx-%lx%s.img", dir, (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+        head->addr, (mode & LAZY_BIND) ? "-lazy" : "");
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static int isWritable(struct segment *seg)
+{
+    return (seg->prot & PROT_WRITE) != 0; //counted with it
+}
+
+static int isSaved(Library *head, Library *lib)
+{
+    //only what this openLibrary mapped, a library shared with another chain may hold live data by now
+    if(lib->fake)
+        return 0;
+    for(Library *curr = head; curr; curr = curr->next)
+        if(curr == lib)
+            return 1;
+    return 0;
+}
+
+//with LAZY_LOAD the scope is whatever got loaded by the time of saving, and GOT entries may point into
+//libraries a later process hasn't loaded, so there's no caching then either
+//nor with PLT_PROFILE, whose GOT entries point at stubs mmapped by this process
+static int usesTls(Library *head)
+{
+    //module IDs and static TLS offsets are handed out per process, so their GOT entries can't be saved
+    Library **order;
+    uint32_t nlibs = scopeOrder(head, &order);
+    int found = 0;
+    for(uint32_t i = 0; i < nlibs; i++)
+        found |= order[i]->tls_modid != 0;
+    free(order);
+    return found;
+}
+
+static int isOurs(Library **order, uint32_t nlibs, uint64_t addr)
+{
+    //an address in something we mapped, which the key pins down
+    for(uint32_t i = 0; i < nlibs; i++)
+        if(!order[i]->fake && addr >= order[i]->addr && addr < order[i]->addr + order[i]->maplength)
+            return 1;
+    return 0;
+}
+
+static uint32_t findFixups(Library **order, uint32_t nlibs, uint32_t index, Elf64_Rela *start, Elf64_Rela *end,
+    struct cacheFixup **fixups, uint32_t n)
+{
+    //append the relocations in [start, end) of order[index] whose symbol isn't ours, returns the new count
+    Library *lib = order[index];
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    for(Elf64_Rela *it = start; it < end; it++)
+    {
+        Elf64_Xword type = ELF64_R_TYPE(it->r_info);
+        if(type == R_X86_64_NONE || type == R_X86_64_RELATIVE || type == R_X86_64_IRELATIVE || isTlsReloc(type)
+            || ELF64_R_SYM(it->r_info) == 0)
+            continue;
+        uint64_t value = *(uint64_t *)(lib->addr + it->r_offset);
+        if(value == 0 || isOurs(order, nlibs, value - it->r_addend))
+            continue; //a weak import nobody defines, or a lazy PLT slot not bound yet
+        if((n & (n - 1)) == 0)
+            *fixups = realloc(*fixups, (n ? n * 2 : 16) * sizeof(struct cacheFixup));
+        (*fixups)[n++] = (struct cacheFixup){index, symtab[ELF64_R_SYM(it->r_info)].st_name, it->r_offset, it->r_addend};
+    }
+    return n;
+}
+
+static uint32_t collectFixups(Library *head, Library **order, uint32_t nlibs, struct cacheFixup **fixups)
+{
+    //imports of the saved libraries that went to fake objects, or anything else ld.so loaded
+    uint32_t n = 0;
+    *fixups = NULL;
+    for(uint32_t i = 0; i < nlibs; i++)
+    {
+        Library *lib = order[i];
+        if(!isSaved(head, lib))
+            continue;
+        if(lib->dyn_info[DT_RELA])
+        {
+            Elf64_Rela *start = (void *)lib->dyn_info[DT_RELA]->d_un.d_ptr;
+            Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[DT_RELASZ]->d_un.d_val);
+            if(lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])
+                start += lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val;
+            n = findFixups(order, nlibs, i, start, end, fixups, n);
+        }
+        if(lib->dyn_info[DT_JMPREL])
+        {
+            Elf64_Rela *start = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+            Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[DT_PLTRELSZ]->d_un.d_val);
+            n = findFixups(order, nlibs, i, start, end, fixups, n);
+        }
+    }
+    return n;
+}
+
+int imageCacheLoad(Library *head, int mode)
+{
+    //map the saved segments over the fresh ones if every key still matches, 1 on success
+    char path[4096];
+    if((mode & (LAZY_LOAD | PLT_PROFILE)) || cachePath(head, mode, path, sizeof(path)) < 0 || usesTls(head))
+        return 0;
+    FILE *f = openCacheFile(path, getuid()); //these pages end up in our GOTs, only our own will do
+    if(!f)
+        return 0;
+
+    //every library in the scope is keyed, since imports may resolve into any of them
+    Library **order;
+    uint32_t nlibs = scopeOrder(head, &order);
+    struct cacheHeader hdr;
+    struct cacheLib libs[nlibs];
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1
+        && hdr.magic == CACHE_MAGIC && hdr.version == CACHE_VERSION
+        && hdr.nlibs == nlibs && hdr.lazy == !!(mode & LAZY_BIND)
+        && fread(libs, sizeof(struct cacheLib), nlibs, f) == nlibs;
+
+    uint32_t nsegs = 0;
+    for(uint32_t i = 0; ok && i < nlibs; i++)
+    {
+        struct cacheKey key;
+        makeKey(order[i], &key);
+        ok = memcmp(&key, &libs[i].key, sizeof(key)) == 0; //a changed file, address or dependency
+        nsegs += libs[i].nsegs;
+    }
+    struct cacheSeg *segs = malloc((nsegs + 1) * sizeof(struct cacheSeg));
+    ok = ok && fread(segs, sizeof(struct cacheSeg), nsegs, f) == nsegs;
+    uint32_t nfixups = ok ? hdr.nfixups : 0;
+    struct cacheFixup *fixups = malloc((nfixups + 1) * sizeof(struct cacheFixup));
+    ok = ok && fread(fixups, sizeof(struct cacheFixup), nfixups, f) == nfixups;
+
+    //the saved segments must line up with what mapWorker just mapped
+    struct cacheSeg *seg = segs;
+    for(uint32_t i = 0; ok && i < nlibs; i++)
+    {
+        Library *lib = order[i];
+        uint32_t n = 0;
+        for(int j = 0; ok && j < lib->nsegs && isSaved(head, lib); j++)
+        {
+            if(!isWritable(&lib->segs[j]))
+                continue;
+            ok = n < libs[i].nsegs && seg[n].start == lib->segs[j].start && seg[n].end == lib->segs[j].end;
+            n++;
+        }
+        ok = ok && n == libs[i].nsegs;
+        seg += libs[i].nsegs;
+    }
+
+    //look the fixups up before the old pages go, a symbol that went missing is just a miss
+    uint64_t *values = malloc((nfixups + 1) * sizeof(uint64_t));
+    for(uint32_t i = 0; ok && i < nfixups; i++)
+    {
+        Library *lib = fixups[i].lib < nlibs ? order[fixups[i].lib] : NULL;
+        void *res = NULL;
+        if(lib && isSaved(head, lib))
+            res = resolveSymbol(lib, (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr + fixups[i].name);
+        ok = res != NULL;
+        values[i] = (uint64_t)res + fixups[i].addend;
+    }
+
+    if(ok)
+    {
+        int fd = fileno(f);
+        for(uint32_t i = 0; i < nsegs; i++)
+        {
+            if(mmap((void *)segs[i].start, segs[i].end - segs[i].start, segs[i].prot,
+                MAP_FILE | MAP_PRIVATE | MAP_FIXED, fd, segs[i].offset) == MAP_FAILED)
+            {
+                //the old pages are gone already, there's no way back to the normal path
+                fprintf(stderr, "imageCache error: mmap failed when restoring %s from %s\n", head->name, path);
+                exit(-1);
+            }
+        }
+        for(uint32_t i = 0; i < nfixups; i++)
+            *(uint64_t *)(order[fixups[i].lib]->addr + fixups[i].offset) = values[i];
+        //GOT[1] and GOT[2] hold addresses of this process, they can't come from the cache
+        for(uint32_t i = 0; i < nlibs; i++)
+        {
+            if(!libs[i].relocated || !isSaved(head, order[i]))
+                continue;
+            relocInit(order[i], mode);
+            order[i]->relocated = 1;
+        }
+    }
+    free(order);
+    free(segs);
+    free(fixups);
+    free(values);
+    fclose(f);
+    return ok;
+}
+
+void imageCacheStore(Library *head, int mode)
+{
+    //save the writable segments of every real object this call mapped, right after relocation
+    char path[4096], tmp[4096 + 32];
+    if((mode & (LAZY_LOAD | PLT_PROFILE)) || cachePath(head, mode, path, sizeof(path)) < 0 || usesTls(head))
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    int fd = createCacheFile(tmp, 0600);
+    if(fd < 0)
+        return; //a cache is a cache, not being able to write it is fine
+
+    Library **order;
+    uint32_t nlibs = scopeOrder(head, &order), nsegs = 0;
+    for(uint32_t i = 0; i < nlibs; i++)
+        for(int j = 0; j < order[i]->nsegs && isSaved(head, order[i]); j++)
+            nsegs += isWritable(&order[i]->segs[j]);
+
+    struct cacheFixup *fixups;
+    uint32_t nfixups = collectFixups(head, order, nlibs, &fixups);
+    struct cacheHeader hdr = {CACHE_MAGIC, CACHE_VERSION, nlibs, !!(mode & LAZY_BIND), nfixups};
+    struct cacheLib libs[nlibs];
+    struct cacheSeg *segs = malloc((nsegs + 1) * sizeof(struct cacheSeg));
+    uint64_t pagesize = getpagesize();
+    uint64_t fixupsAt = sizeof(hdr) + sizeof(libs) + nsegs * sizeof(struct cacheSeg);
+    uint64_t offset = ALIGN_UP(fixupsAt + nfixups * sizeof(struct cacheFixup), pagesize);
+    struct cacheSeg *seg = segs;
+    int ok = 1;
+    for(uint32_t i = 0; i < nlibs; i++)
+    {
+        Library *lib = order[i];
+        makeKey(lib, &libs[i].key);
+        libs[i].relocated = lib->relocated;
+        libs[i].nsegs = 0;
+        for(int j = 0; j < lib->nsegs && isSaved(head, lib); j++)
+        {
+            if(!isWritable(&lib->segs[j]))
+                continue;
+            seg->start = lib->segs[j].start;
+            seg->end = lib->segs[j].end;
+            seg->prot = lib->segs[j].prot;
+            seg->offset = offset;
+            uint64_t len = seg->end - seg->start;
+            ok = ok && pwrite(fd, (void *)seg->start, len, offset) == (ssize_t)len;
+            offset += len;
+            seg++;
+            libs[i].nsegs++;
+        }
+    }
+    ok = ok && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+        && pwrite(fd, libs, sizeof(libs), sizeof(hdr)) == sizeof(libs)
+        && pwrite(fd, segs, nsegs * sizeof(struct cacheSeg), sizeof(hdr) + sizeof(libs))
+            == (ssize_t)(nsegs * sizeof(struct cacheSeg))
+        && pwrite(fd, fixups, nfixups * sizeof(struct cacheFixup), fixupsAt)
+            == (ssize_t)(nfixups * sizeof(struct cacheFixup));
+    close(fd);
+    free(order);
+    free(segs);
+    free(fixups);
+    //rename is atomic, so a reader sees either the old image or the complete new one
+    if(!ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
@@ -0,0 +1,129 @@
+//load the same library many times at different addresses, paying for name lookups only once
+//the first openInstances records where every import of the library went (the plan), each instance
+//then gets fresh pages, its base-relative relocations, and the plan written back in
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+struct planEntry
+{
+    uint64_t offset; //of the word to write, from the load address
+    uint64_t value; //what goes there, plus the load address if self is set
+    int self; //the import resolved to the library itself, so it moves with each instance
+    int plt; //a jump slot, lazily bound instances leave it to runtimeResolve
+};
+
+struct instancePlan
+{
+    struct planEntry *entries;
+    uint64_t n;
+};
+
+extern void *resolveSymbol(Library *lib, const char *name);
+extern Library *mapInstance(Library *src, void *addr);
+extern void relocInstance(Library *lib, int mode);
+extern void lockRegistry(void);
+extern void unlockRegistry(void);
+extern Library *libraryOf(void *library);
+
+static void planRange(Library *lib, struct instancePlan *plan, Elf64_Rela *start, Elf64_Rela *end, int plt)
+{
+    //resolve like relocSymbolic and relocJumpSlots do, but write down the answer instead
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+    for(Elf64_Rela *it = start; it < end; it++)
+    {
+        Elf64_Addr value;
+        if(isTlsReloc(ELF64_R_TYPE(it->r_info)))
+            continue; //every instance is a TLS module of its own, see relocInstance
+        if(ELF64_R_TYPE(it->r_info) == R_X86_64_NONE)
+            continue;
+        if(ELF64_R_TYPE(it->r_info) == R_X86_64_RELATIVE)
+            value = lib->addr + it->r_addend; //no DT_RELACOUNT to keep them out of here, self relative below
+        else if(ELF64_R_TYPE(it->r_info) == R_X86_64_IRELATIVE)
+            value = ((Elf64_Addr(*)(void))(lib->addr + it->r_addend))();
+        else
+        {
+            void *res = resolveSymbol(lib, strtab + symtab[ELF64_R_SYM(it->r_info)].st_name);
+            if(!res)
+                continue; //left as it is in the file, like relocLibrary does
+            value = (Elf64_Addr)res + it->r_addend;
+        }
+        struct planEntry *e = &plan->entries[plan->n++];
+        e->offset = it->r_offset;
+        e->plt = plt && ELF64_R_TYPE(it->r_info) != R_X86_64_IRELATIVE; //lazyReloc leaves those to us too
+        e->self = value >= lib->addr && value < lib->addr + lib->maplength;
+        e->value = e->self ? value - lib->addr : value;
+    }
+}
+
+static struct instancePlan *buildPlan(Library *lib)
+{
+    //jump slots are planned even if lib binds lazily, its instances may not
+    struct instancePlan *plan = calloc(1, sizeof(struct instancePlan));
+    Elf64_Rela *sym_start = NULL, *sym_end = NULL, *plt_start = NULL, *plt_end = NULL;
+    if(lib->dyn_info[DT_RELA])
+    {
+        Elf64_Addr start = lib->dyn_info[DT_RELA]->d_un.d_ptr;
+        Elf64_Xword nrelative = (lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])?
+            lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val : 0;
+        sym_start = (Elf64_Rela *)start + nrelative;
+        sym_end = (void *)(start + lib->dyn_info[DT_RELASZ]->d_un.d_val);
+    }
+    if(lib->dyn_info[DT_JMPREL])
+    {
+        plt_start = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+        plt_end = (void *)((Elf64_Addr)plt_start + lib->dyn_info[DT_PLTRELSZ]->d_un.d_val);
+    }
+    plan->entries = malloc(((sym_end - sym_start) + (plt_end - plt_start) + 1) * sizeof(struct planEntry));
+    planRange(lib, plan, sym_start, sym_end, 0);
+    planRange(lib, plan, plt_start, plt_end, 1);
+    return plan;
+}
+
+static void replayPlan(Library *lib, struct instancePlan *plan, int mode)
+{
+    for(uint64_t i = 0; i < plan->n; i++)
+    {
+        struct planEntry *e = &plan->entries[i];
+        if(e->plt && (mode & LAZY_BIND))
+            continue;
+        *(Elf64_Addr *)(lib->addr + e->offset) = e->self ? e->value + lib->addr : e->value;
+    }
+}
+
+void openInstances(void *library, int mode, int count, void **addrs, void **instances)
+{
+    Library *src = libraryOf(library);
+    if(src->fake)
+    {
+        fprintf(stderr, "openInstances error: %s is loaded by dlopen, it can't have instances\n", src->name);
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&src->reloc_lock);
+    if(!src->instance_plan)
+        src->instance_plan = buildPlan(src);
+    struct instancePlan *plan = src->instance_plan;
+    pthread_mutex_unlock(&src->reloc_lock);
+
+    for(int i = 0; i < count; i++)
+    {
+        lockRegistry();
+        Library *lib = mapInstance(src, addrs ? addrs[i] : NULL);
+        unlockRegistry();
+        relocInstance(lib, mode);
+        replayPlan(lib, plan, mode);
+        instances[i] = lib;
+    }
+}
+
+void instancePlanRelease(Library *lib)
+{
+    if(!lib->instance_plan)
+        return;
+    free(lib->instance_plan->entries);
+    free(lib->instance_plan);
+    lib->instance_plan = NULL;
+}
@@ -0,0 +1,133 @@
+//LAZY_LOAD, like -z lazyload on Solaris: mapWorker only writes down the DT_NEEDED entries nobody has loaded
+//yet, and they're mapped and relocated the first time an import of the library isn't found in what's loaded.
+//search_list has a slot for every DT_NEEDED, so a dependency loaded later takes the next free one and
+//lookups walking it meanwhile see either the NULL terminator or a library ready for use
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+struct lazyDeps
+{
+    pthread_mutex_t lock; //held while loading, so each one is loaded once
+    int mode;
+    int first_slot; //of search_list, where the first one goes once loaded
+    int n, loaded; //they're loaded in DT_NEEDED order
+    char **names;
+    char *rpath, *runpath; //the library's own, for finding them
+};
+
+extern void *symbolLookup(Library *dep, const char *name);
+extern FILE *resolveLibrary(const char *name, const char *rpath, const char *runpath, uint64_t *probes);
+extern FILE *resolveImage(Library *lib);
+extern void* isLibraryOpen(const char *name);
+extern void lockRegistry(void);
+extern void unlockRegistry(void);
+
+static struct lazyDeps *newLazyDeps(int mode, int first_slot, const char *rpath, const char *runpath)
+{
+    struct lazyDeps *d = calloc(1, sizeof(struct lazyDeps));
+    pthread_mutex_init(&d->lock, NULL);
+    d->mode = mode;
+    d->first_slot = first_slot;
+    d->rpath = rpath ? strdup(rpath) : NULL;
+    d->runpath = runpath ? strdup(runpath) : NULL;
+    return d;
+}
+
+static void addName(struct lazyDeps *d, const char *name)
+{
+    d->names = realloc(d->names, (d->n + 1) * sizeof(char *));
+    d->names[d->n++] = strdup(name);
+}
+
+void lazyDefer(Library *lib, const char *name, const char *rpath, const char *runpath, int mode)
+{
+    //called by mapWorker for every dependency it leaves for later, in DT_NEEDED order
+    if(!lib->lazy_deps)
+        lib->lazy_deps = newLazyDeps(mode, 0, rpath, runpath);
+    addName(lib->lazy_deps, name);
+}
+
+void lazyDeferDone(Library *lib, int first_slot)
+{
+    //mapWorker is through with DT_NEEDED, the ones it did load took search_list[1 .. first_slot - 1]
+    if(lib->lazy_deps)
+        lib->lazy_deps->first_slot = first_slot;
+}
+
+int lazyInherit(Library *src, Library *lib, int first_slot)
+{
+    //an instance of src defers what src hasn't loaded by the time it's copied, see mapInstance.
+    //returns how many slots of search_list that needs. Can't take src's lock with the registry held,
+    //but names never change and what's loaded is what the instance found in src's search_list
+    struct lazyDeps *s = src->lazy_deps;
+    int loaded = first_slot - s->first_slot, pending = s->n - loaded;
+    if(pending <= 0)
+        return 0;
+    lib->lazy_deps = newLazyDeps(s->mode, first_slot, s->rpath, s->runpath);
+    for(int i = loaded; i < s->n; i++)
+        addName(lib->lazy_deps, s->names[i]);
+    return pending;
+}
+
+static Library *loadOne(struct lazyDeps *d, const char *name, const char *requester)
+{
+    //openLibrary it, found the way openDep would have found it from the library that needs it
+    lockRegistry();
+    int known = isLibraryOpen(name) != NULL;
+    unlockRegistry();
+    if(known)
+        return openLibrary(name, d->mode, NULL);
+    Library probe = {0};
+    probe.name = (char *)name;
+    uint64_t probes = 0;
+    FILE *fs = resolveImage(&probe); //the caller's resolver goes first, see setLibraryResolver
+    if(!fs)
+        fs = resolveLibrary(name, d->rpath, d->runpath, &probes);
+    if(!fs)
+    {
+        fprintf(stderr, "lazyLoad error: unable to open %s as a dependency of %s\n", name, requester);
+        exit(-1);
+    }
+    Library *dep = openLibraryFromFd(fileno(fs), probe.file_offset, name, d->mode, NULL);
+    fclose(fs);
+    return dep;
+}
+
+void *lazyLoadSymbol(Library *lib, const char *name)
+{
+    //an import of lib that nothing loaded defines: look in the deferred dependencies loaded so far,
+    //then load the others one at a time until one has it
+    struct lazyDeps *d = lib->lazy_deps;
+    void *res = NULL;
+    pthread_mutex_lock(&d->lock);
+    for(int i = 0; i < d->loaded && !res; i++)
+        res = symbolLookup(lib->search_list[d->first_slot + i], name);
+    while(!res && d->loaded < d->n)
+    {
+        Library *dep = loadOne(d, d->names[d->loaded], lib->name);
+        //the reference openLibrary gave is lib's, closeLibrary drops it like any other dependency's
+        __atomic_store_n(&lib->search_list[d->first_slot + d->loaded], dep, __ATOMIC_RELEASE);
+        d->loaded++;
+        res = symbolLookup(dep, name);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return res;
+}
+
+void lazyRelease(Library *lib)
+{
+    struct lazyDeps *d = lib->lazy_deps;
+    if(!d)
+        return;
+    lib->lazy_deps = NULL;
+    for(int i = 0; i < d->n; i++)
+        free(d->names[i]);
+    free(d->names);
+    free(d->rpath);
+    free(d->runpath);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
@@ -6,28 +6,67 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <elf.h>
+#include <pthread.h>
 
 //in glibc there is a cluster of rules to map these OS-specific flags into array indice
 //Here I make it simple by appending the flags I need after DT_NUM
-#define OS_SPECIFIC_FLAG 2
+#define OS_SPECIFIC_FLAG 4
 #define DT_RELACOUNT_NEW 0
 #define DT_GNU_HASH_NEW 1
+//DT_RELR is generic, but older elf.h neither defines it nor counts it in DT_NUM, so it gets its own slots too
+#define DT_RELR_NEW 2
+#define DT_RELRSZ_NEW 3
+#ifndef DT_RELR
+#define DT_RELRSZ 35
+#define DT_RELR 36
+#define DT_RELRENT 37
+#endif
+
+//a PT_LOAD segment as it sits in memory, page aligned and absolute
+struct segment
+{
+    uint64_t start, end;
+    int prot;
+};
 
 typedef struct libraryInternal
 {
     uint64_t addr;
+    uint64_t maplength; //address space taken from addr on, see mapSegment
     char *name;
+    int refcount; //one per openLibrary of it, plus one per library that has it in DT_NEEDED
+    int gc_refs; //scratch of collectCycles, see closeLibrary.c
     Elf64_Dyn *dyn;
     Elf64_Dyn *dyn_info[DT_NUM + OS_SPECIFIC_FLAG];
     int dyn_num;
+    Elf64_Phdr *phdr; //program headers read by mapWorker, kept for a second look
+    uint16_t phnum;
+    struct segment *segs;
+    int nsegs;
     struct libraryInternal **search_list;
-    struct libraryInternal *next;
+    struct libraryInternal *next; //next one mapped by the same mapLibrary call
+    struct libraryInternal *loaded_next; //every library in the process, see registry.c
+    struct registryEntry *registry_keys; //the names and file it's registered under
     FILE *fs;
+    uint64_t file_offset; //where the ELF image starts in fs, not 0 for a range of a bigger file
     int relocated;
+    pthread_mutex_t reloc_lock; //held by whoever relocates it, see relocScheduler
     int fake; // this is a currently unresolvable bug: some .so like libc, 
     //I can't map it correctly, so I just borrow dlopen, hopefully I can solve it later
     //see: https://sourceware.org/pipermail/libc-help/2021-January/005615.html
     void *fake_handle; //after fake search, use this handle to dl-close it
+    struct fakeMemoTable *fake_memo; //what dlsym answered for each name, see fakeLibrary.c
+    uint64_t fake_dlopen_calls, fake_dlsym_calls, fake_memo_hits;
+    struct scopeIndex *scope; //merged lookup table of the chain that mapped us, NULL if not asked for or its head is gone
+    struct pltProfile *plt_profile; //per PLT slot call counters, see PLT_PROFILE
+    struct traceData *trace; //phase timings and counters, NULL unless traced, see trace.h
+    struct instancePlan *instance_plan; //imports resolved once for all its instances, see instances.c
+    uint64_t tls_modid; //0 if it has no PT_TLS, see tls.c
+    int64_t tls_offset; //of its TLS block from the thread pointer if in static TLS, else 0
+    struct asyncOpen *async; //only set in handles of openLibraryAsync, which stand for a library still loading
+    struct funcIndex *func_index; //its functions sorted by address, built by the first addressToSymbol in it
+    struct lazyDeps *lazy_deps; //DT_NEEDED entries not loaded until needed, see LAZY_LOAD
+    struct deferredIfunc *ifunc_pending; //imports bound to its IFUNCs before it was relocated, see symbolLookup
 
     /* symbol lookup thing borrowed from ld.so */
     uint32_t l_nbuckets;
@@ -36,8 +75,45 @@ typedef struct libraryInternal
     const Elf64_Addr *l_gnu_bitmask;
     const Elf32_Word *l_gnu_buckets;
     const Elf32_Word *l_gnu_chain_zero;
+    //classic SysV DT_HASH, only used when the object has no DT_GNU_HASH
+    const Elf32_Word *l_buckets;
+    const Elf32_Word *l_chain;
 
 } Library;
 
+//apply relocations [start, end) of lib, the unit of work handed to relocation threads
+typedef void (*relocRange)(Library *lib, Elf64_Rela *start, Elf64_Rela *end);
+
+//relocations against thread-local storage, they go to relocTls in tls.c
+static inline int isTlsReloc(Elf64_Xword type)
+{
+    return type == R_X86_64_DTPMOD64 || type == R_X86_64_DTPOFF64 || type == R_X86_64_TPOFF64;
+}
+
+// glibc version to hash a symbol, used by DT_GNU_HASH
+static inline uint_fast32_t
+dl_new_hash(const char *s)
+{
+    uint_fast32_t h = 5381;
+    for (unsigned char c = *s; c != '\0'; c = *++s)
+        h = h * 33 + c;
+    return h & 0xffffffff;
+}
+
+// the good old ELF hash, used by DT_HASH
+static inline unsigned long
+dl_elf_hash(const char *s)
+{
+    unsigned long h = 0, g;
+    for (unsigned char c = *s; c != '\0'; c = *++s)
+    {
+        h = (h << 4) + c;
+        g = h & 0xf0000000;
+        h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 //map the shared object into memory, and also generate a struct Library for it
 #include "library.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,37 +8,84 @@
 #include <elf.h>
 #include <unistd.h> //for getpagesize
 #include <sys/mman.h>
+#include <fcntl.h> //for posix_fadvise
+#include <pthread.h>
+#include "dl-rebuild.h"
 
 #define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
 #define ALIGN_UP(base, size) ALIGN_DOWN((base) + (size)-1, (size))
 
-static const char *sys_path[] = {
-    "/usr/lib/x86_64-linux-gnu/",
-    "/lib/x86_64-linux-gnu/",
-    ""
-};
-
 static const char *fake_so[] = {
     "libc.so.6",
     "ld-linux.so.2",
+    "ld-linux-x86-64.so.2", //needed by everything that calls __tls_get_addr, which is ours anyway
     ""
 };
 
+#define PIPELINE_THREADS 8 //they mostly wait for the disk, so this doesn't follow the core count
+
+//a dependency whose file is being opened and read in the background, see PIPELINED_MAP
+struct mapJob
+{
+    Library *lib;
+    const char *rpath, *runpath; //both point into the requester's mapped strtab
+    const char *requester; //name of who needs it, for error messages
+    int error; //0, or what went wrong
+    int done;
+    struct mapJob *next; //in discovery order, which is also the order of the chain
+};
+
+struct mapPipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued, finished;
+    struct mapJob *first, *last;
+    struct mapJob *untaken; //first job no worker has picked up yet
+    int stop;
+    pthread_t workers[PIPELINE_THREADS];
+    int nworkers;
+};
+
 //fill in an almost empty Library, and put its deps on
-static uint64_t mapWorker(Library *lib, void *addr);
+//`tail` is the end of the chain this mapLibrary call is building
+static uint64_t mapWorker(Library *lib, void *addr, Library **tail, struct mapPipeline *pipe, int mode);
+
+extern uint64_t allocRange(uint64_t len);
+extern uint64_t allocRangeAligned(uint64_t len, uint64_t align, uint64_t offset);
+extern uint64_t textAlignment(Elf64_Phdr *phdr, uint16_t phnum, uint64_t *text_offset);
+extern void promoteText(Library *lib);
+extern void tlsRegister(Library *lib);
+extern void pageProfileReplay(Library *lib);
+extern void addressIndexAdd(Library *lib);
+extern void lazyDefer(Library *lib, const char *name, const char *rpath, const char *runpath, int mode);
+extern void lazyDeferDone(Library *lib, int first_slot);
+extern int lazyInherit(Library *src, Library *lib, int first_slot);
+
+extern void* isLibraryOpen(const char *name);
+extern void registerLibrary(Library *lib);
+extern void registerName(Library *lib, const char *name);
+extern Library *registerFile(Library *lib);
+extern void unregisterLibrary(Library *lib);
 
-Library *openedHead = NULL;
-Library *openedTail = NULL; //we need a tail for single library can put multiple deps on list
-static void* isLibraryOpen(const char *name)
+static Library *newLibrary(char *name, int mode)
 {
-    Library *search = openedHead;
-    while (search)
-    {
-        if(strcmp(name, search->name) == 0)
-            return search;
-        search = search->next;
-    }
-    return NULL;
+    Library *lib = calloc(sizeof(Library), 1);
+    lib->name = name;
+    pthread_mutex_init(&lib->reloc_lock, NULL);
+    TRACE_START(lib, mode);
+    return lib;
+}
+
+static void discardLibrary(Library *lib)
+{
+    //a Library that never got mapped
+    if(lib->fs)
+        fclose(lib->fs);
+    free(lib->phdr);
+    free(lib->trace);
+    free(lib->name);
+    pthread_mutex_destroy(&lib->reloc_lock);
+    free(lib);
 }
 
 static int doFakeLoad(const char *libname)
@@ -50,81 +98,255 @@ static int doFakeLoad(const char *libname)
     return 0;
 }
 
-static FILE *openFile(const char *name)
+extern FILE *resolveLibrary(const char *name, const char *rpath, const char *runpath, uint64_t *probes);
+extern FILE *resolveImage(Library *lib);
+extern FILE *openImage(Library *lib, const struct libraryImage *image);
+
+static FILE *openDep(Library *lib, const char *rpath, const char *runpath)
+{
+    // we do one step more when open a so as a dependency
+    uint64_t probes = 0;
+    TRACE_BEGIN(start);
+    FILE *fs = resolveImage(lib); //the caller's resolver goes first, see setLibraryResolver
+    if(!fs)
+        fs = resolveLibrary(lib->name, rpath, runpath, &probes);
+    TRACE_END(lib, TRACE_RESOLVE, start);
+    TRACE_COUNT(lib, TRACE_FILES_PROBED, probes);
+    return fs;
+}
+
+static FILE *openFile(Library *lib)
 {
-    // go for it if it's an absolute path
-    if(strchr(name, '/')) return fopen(name, "rb");
+    return openDep(lib, NULL, NULL);
+}
+
+enum
+{
+    HEADER_OK = 0,
+    HEADER_NO_FILE,
+    HEADER_NO_EHDR,
+    HEADER_NO_PHDR,
+};
+
+static int readHeaders(Library *lib)
+{
+    char tmp_ehdr[832]; //this strange number is for compatiable issues, refer to glibc
+    if(!fread(tmp_ehdr, sizeof(Elf64_Ehdr), 1, lib->fs))
+        return HEADER_NO_EHDR;
 
-    char tmp[128]; //temporary array for checking FILE availability
-    *tmp = 0;
-    for(const char **s = sys_path; *s; s++)
+    //get the elf header, now to read the program header
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)tmp_ehdr;
+    uint16_t phnum = ehdr->e_phnum;
+    uint64_t phlen = phnum * sizeof(Elf64_Phdr);
+    Elf64_Phdr *phdr = malloc(phlen);
+    if(!fread(phdr, phlen, 1, lib->fs))
     {
-        strcat(tmp, *s);
-        strcat(tmp, name);
-        FILE *curr = fopen(tmp, "rb");
-        if(curr) return curr;
-        *tmp = 0; //flush the array
+        free(phdr);
+        return HEADER_NO_PHDR;
     }
-    return NULL;
+    lib->phdr = phdr;
+    lib->phnum = phnum;
+    return HEADER_OK;
 }
 
-static FILE *openDep(const char *name, const char *runpath)
+static void reportHeaderError(int error, Library *lib, const char *requester)
 {
-    // we do one step more when open a so as a dependency
-    if(runpath == NULL)
-        return openFile(name);
-    char *p, *last;
-    FILE *curr;
-    char *xpath = strdup(runpath);
-    for((p = strtok_r(xpath, ":", &last)); p; p = strtok_r(NULL, ":", &last))
+    switch (error)
     {
-        char tmp_name[128];
-        *tmp_name = '\0';
-        strcat(tmp_name, p);
-        strcat(tmp_name, "/");
-        strcat(tmp_name, name);
-        curr = fopen(tmp_name, "rb");
-        if(curr)
+    case HEADER_NO_FILE:
+        fprintf(stderr, "mapLibrary error: unable to open %s as a dependency of %s",
+            lib->name, requester);
+        break;
+    case HEADER_NO_EHDR:
+        fprintf(stderr, "mapLibrary error: cannot read ELF header of file %s", lib->name);
+        break;
+    case HEADER_NO_PHDR:
+        fprintf(stderr, "mapLibrary error: cannot read ELF program header of file %s", lib->name);
+        break;
+    default:
+        return;
+    }
+    exit(-1);
+}
+
+static void *pipelineWorker(void *arg)
+{
+    //resolve the path, read the headers and start readahead of a dependency nobody maps yet
+    struct mapPipeline *pipe = arg;
+    while(1)
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while(!pipe->untaken && !pipe->stop)
+            pthread_cond_wait(&pipe->queued, &pipe->lock);
+        struct mapJob *job = pipe->untaken;
+        if(!job)
         {
-            free(xpath);
-            return curr;
+            pthread_mutex_unlock(&pipe->lock);
+            return NULL;
         }
+        pipe->untaken = job->next;
+        pthread_mutex_unlock(&pipe->lock);
+
+        Library *lib = job->lib;
+        lib->fs = openDep(lib, job->rpath, job->runpath);
+        int error = lib->fs ? readHeaders(lib) : HEADER_NO_FILE;
+        if(error == HEADER_OK)
+            posix_fadvise(fileno(lib->fs), 0, 0, POSIX_FADV_WILLNEED); //the mmaps will want it soon
+
+        pthread_mutex_lock(&pipe->lock);
+        job->error = error;
+        job->done = 1;
+        pthread_cond_broadcast(&pipe->finished);
+        pthread_mutex_unlock(&pipe->lock);
     }
-    free(xpath);
-    //maybe it's in system path?
-    curr = openFile(name);
-    if(curr) return curr;
+}
 
-    return NULL;
+static void pipelineSubmit(struct mapPipeline *pipe, Library *lib, const char *rpath, const char *runpath,
+    const char *requester)
+{
+    struct mapJob *job = calloc(1, sizeof(struct mapJob));
+    job->lib = lib;
+    job->rpath = rpath;
+    job->runpath = runpath;
+    job->requester = requester;
+    pthread_mutex_lock(&pipe->lock);
+    if(pipe->last)
+        pipe->last->next = job;
+    else
+        pipe->first = job;
+    pipe->last = job;
+    if(!pipe->untaken)
+        pipe->untaken = job;
+    pthread_cond_signal(&pipe->queued);
+    pthread_mutex_unlock(&pipe->lock);
 }
 
-void *mapLibrary(const char *name, void *addr)
+static void pipelineWait(struct mapPipeline *pipe, Library *lib)
+{
+    //jobs come in the same order as the chain, so the one we want is always the oldest
+    pthread_mutex_lock(&pipe->lock);
+    struct mapJob *job = pipe->first;
+    while(!job->done)
+        pthread_cond_wait(&pipe->finished, &pipe->lock);
+    pipe->first = job->next;
+    if(!pipe->first)
+        pipe->last = NULL;
+    pthread_mutex_unlock(&pipe->lock);
+
+    if(job->lib != lib)
+    {
+        fprintf(stderr, "mapLibrary error: pipeline out of order at %s\n", lib->name);
+        exit(-1);
+    }
+    reportHeaderError(job->error, lib, job->requester);
+    free(job);
+}
+
+static void foldDuplicate(Library *head, Library *prev, Library *dup, Library *same, Library **tail)
+{
+    //dup is a file we have mapped already as `same`, under another name. Nothing after dup in the chain
+    //is mapped yet, so only those before it may have it in their search_list
+    for(Library *lib = head; lib != dup; lib = lib->next)
+        for(Library **dep = lib->search_list + 1; *dep; dep++)
+            if(*dep == dup)
+                *dep = same;
+    same->refcount += dup->refcount;
+    prev->next = dup->next;
+    if(*tail == dup)
+        *tail = prev;
+    unregisterLibrary(dup);
+    registerName(same, dup->name); //so whoever else needs it by that name finds it right away
+    discardLibrary(dup);
+}
+
+void *mapLibraryImage(const char *name, const struct libraryImage *image, void *addr, int mode, int *reused)
 {
     // map a shared object and its dependencies compactly together 
+    //the head comes from `image` if there is one, otherwise from the file `name`.
+    //if that file is mapped already under another name, that library is returned and *reused set
     
-    FILE *lib = openFile(name);
-    if(!lib)
+    //make name have a solid place, so if it depend on other lib, its name won't be freed when its dep is freed
+    Library *head = newLibrary(strdup(name), mode);
+    head->fs = image ? openImage(head, image) : openFile(head);
+    if(!head->fs)
     {
-        fprintf(stderr, "mapLibrary error: file %s not found.\n", name);
+        fprintf(stderr, image ? "mapLibrary error: cannot open the image of %s.\n"
+                              : "mapLibrary error: file %s not found.\n", name);
         exit(-1);
     }
-    openedHead = calloc(sizeof(Library), 1);
-    openedHead->fs = lib;
-    //make name have a solid place, so if it depend on other lib, its name won't be freed when its dep is freed
-    openedHead->name = strdup(name); 
-    openedTail = openedHead;
+    Library *same = registerFile(head);
+    *reused = same != NULL;
+    if(same)
+    {
+        registerName(same, name);
+        discardLibrary(head);
+        return same;
+    }
+    head->refcount = 1; //the caller's reference
+    registerLibrary(head);
+    Library *tail = head; //we need a tail for single library can put multiple deps on list
+
+    //with PIPELINED_MAP, dependencies are opened and read by a few threads as soon as they're known,
+    //while this thread keeps mapping in chain order, so addresses come out exactly as in the serial path
+    struct mapPipeline *pipe = NULL;
+    if(mode & PIPELINED_MAP)
+    {
+        pipe = calloc(1, sizeof(struct mapPipeline));
+        pthread_mutex_init(&pipe->lock, NULL);
+        pthread_cond_init(&pipe->queued, NULL);
+        pthread_cond_init(&pipe->finished, NULL);
+        for(; pipe->nworkers < PIPELINE_THREADS; pipe->nworkers++)
+            if(pthread_create(&pipe->workers[pipe->nworkers], NULL, pipelineWorker, pipe) != 0)
+                break;
+        if(pipe->nworkers == 0)
+        {
+            free(pipe);
+            pipe = NULL; //no threads, no pipeline
+        }
+    }
 
-    Library *curr = openedHead;
+    Library *curr = head, *prev = NULL;
     uint64_t curr_addr = (uint64_t)addr;
     while(curr != NULL)
     {
-        curr_addr += mapWorker(curr, (void *)curr_addr);
+        if(pipe && curr != head)
+            pipelineWait(pipe, curr);
+        //only now is its file open, with the pipeline or without
+        Library *same = curr != head ? registerFile(curr) : NULL;
+        if(same)
+        {
+            foldDuplicate(head, prev, curr, same, &tail);
+            curr = prev->next;
+            continue;
+        }
+        //without an address from the caller, every library gets its own spot from the allocator
+        uint64_t maplength = mapWorker(curr, addr ? (void *)curr_addr : NULL, &tail, pipe, mode);
+        if(addr)
+            curr_addr += maplength;
+        prev = curr;
         curr = curr->next;
     }
 
+    if(pipe)
+    {
+        pthread_mutex_lock(&pipe->lock);
+        pipe->stop = 1;
+        pthread_cond_broadcast(&pipe->queued);
+        pthread_mutex_unlock(&pipe->lock);
+        for(int i = 0; i < pipe->nworkers; i++)
+            pthread_join(pipe->workers[i], NULL);
+        free(pipe);
+    }
+
     //now life is sane, we've finished building the shared object and its deps as a whole chain
     //with the head pointer returned, we can traverse this chain later
-    return openedHead;
+    return head;
+}
+
+void *mapLibrary(const char *name, void *addr, int mode)
+{
+    int reused;
+    return mapLibraryImage(name, NULL, addr, mode, &reused);
 }
 
 /* struct to store PT_LOAD info */
@@ -169,11 +391,21 @@ static uint64_t mapSegment(Library *lib, Elf64_Phdr *phdr, void *addr, uint16_t
         }
     }
 
+    //remember what goes where, the mapping itself is no longer needed after this
+    lib->segs = malloc(nloadcmd * sizeof(struct segment));
+    lib->nsegs = nloadcmd;
+    for(int i = 0; i < nloadcmd; i++)
+    {
+        lib->segs[i].start = (uint64_t)addr + loadcmds[i].mapstart;
+        lib->segs[i].end = (uint64_t)addr + ALIGN_UP(loadcmds[i].allocend, pagesize);
+        lib->segs[i].prot = loadcmds[i].prot;
+    }
+
     //now loading...
     uint64_t maplength = loadcmds[nloadcmd - 1].allocend - loadcmds[0].mapstart;
     struct loadcmd *c = loadcmds;
     int fd = fileno(lib->fs);
-    if(mmap(addr, maplength, c->prot, MAP_FILE | MAP_PRIVATE | MAP_FIXED, fd, c->mapoff) < 0)
+    if(mmap(addr, maplength, c->prot, MAP_FILE | MAP_PRIVATE | MAP_FIXED, fd, c->mapoff + lib->file_offset) == MAP_FAILED)
     {
         //ask for maplength B of contigious memory at addr, fails if cannot allocate
         fprintf(stderr, "mapLibrary error: mmap failed when trying to load %s", lib->name);
@@ -182,7 +414,7 @@ static uint64_t mapSegment(Library *lib, Elf64_Phdr *phdr, void *addr, uint16_t
     while(c < &loadcmds[nloadcmd])
     {
         mmap((void *) (c->mapstart + addr), c->mapend - c->mapstart, c->prot,
-                MAP_FILE | MAP_PRIVATE | MAP_FIXED, fd, c->mapoff);
+                MAP_FILE | MAP_PRIVATE | MAP_FIXED, fd, c->mapoff + lib->file_offset);
         if(c->allocend > c->dataend)
         {
             // here comes the .bss
@@ -215,7 +447,11 @@ static void fill_info(Library *lib)
 
     while (dyn->d_tag != DT_NULL)
     {
-        if ((Elf64_Xword)dyn->d_tag < DT_NUM)
+        if ((Elf64_Xword)dyn->d_tag == DT_RELR)
+            dyn_info[DT_NUM + DT_RELR_NEW] = dyn;
+        else if ((Elf64_Xword)dyn->d_tag == DT_RELRSZ)
+            dyn_info[DT_NUM + DT_RELRSZ_NEW] = dyn;
+        else if ((Elf64_Xword)dyn->d_tag < DT_NUM)
             dyn_info[dyn->d_tag] = dyn;
         else if ((Elf64_Xword)dyn->d_tag == DT_RELACOUNT)
             //info[ DT_NUM + (DT_VERNEEDNUM - dyn->d_tag)] = dyn; //this is a quick fix for relacount
@@ -231,68 +467,115 @@ static void fill_info(Library *lib)
             if (dyn_info[tag])                          \
                 dyn_info[tag]->d_un.d_ptr += lib->addr; \
         } while (0)
+    rebase(DT_HASH);
     rebase(DT_SYMTAB);
     rebase(DT_STRTAB);
     rebase(DT_RELA);
     rebase(DT_JMPREL);
     rebase(DT_NUM + DT_GNU_HASH_NEW); //DT_GNU_HASH
+    rebase(DT_NUM + DT_RELR_NEW); //DT_RELR
     rebase(DT_PLTGOT);
 }
 
 static void setup_hash(Library *l)
 {
-    uint32_t *hash;
-
     /* borrowed from dl-lookup.c:_dl_setup_hash */
-    Elf32_Word *hash32 = (Elf32_Word *)l->dyn_info[DT_NUM + DT_GNU_HASH_NEW]->d_un.d_ptr;
-    l->l_nbuckets = *hash32++;
-    Elf32_Word symbias = *hash32++;
-    Elf32_Word bitmask_nwords = *hash32++;
+    if(l->dyn_info[DT_NUM + DT_GNU_HASH_NEW])
+    {
+        Elf32_Word *hash32 = (Elf32_Word *)l->dyn_info[DT_NUM + DT_GNU_HASH_NEW]->d_un.d_ptr;
+        l->l_nbuckets = *hash32++;
+        Elf32_Word symbias = *hash32++;
+        Elf32_Word bitmask_nwords = *hash32++;
+
+        l->l_gnu_bitmask_idxbits = bitmask_nwords - 1;
+        l->l_gnu_shift = *hash32++;
 
-    l->l_gnu_bitmask_idxbits = bitmask_nwords - 1;
-    l->l_gnu_shift = *hash32++;
+        l->l_gnu_bitmask = (Elf64_Addr *)hash32;
+        hash32 += 64 / 32 * bitmask_nwords;
 
-    l->l_gnu_bitmask = (Elf64_Addr *)hash32;
-    hash32 += 64 / 32 * bitmask_nwords;
+        l->l_gnu_buckets = hash32;
+        hash32 += l->l_nbuckets;
+        l->l_gnu_chain_zero = hash32 - symbias;
+        return;
+    }
 
-    l->l_gnu_buckets = hash32;
-    hash32 += l->l_nbuckets;
-    l->l_gnu_chain_zero = hash32 - symbias;
+    //objects built with --hash-style=sysv only have the old DT_HASH
+    if(!l->dyn_info[DT_HASH])
+        return; //leave l_nbuckets to 0, lookups will simply miss
+    Elf32_Word *hash = (Elf32_Word *)l->dyn_info[DT_HASH]->d_un.d_ptr;
+    l->l_nbuckets = *hash++;
+    hash++; //skip nchain
+    l->l_buckets = hash;
+    hash += l->l_nbuckets;
+    l->l_chain = hash;
 }
 
-static uint64_t mapWorker(Library *lib, void *addr)
+static uint64_t mapLength(Elf64_Phdr *phdr, uint16_t phnum)
 {
-    // fill in the infomation and allocate space for shared object specified by lib
-    lib->addr = (uint64_t)addr;
-
-    char tmp_ehdr[832]; //this strange number is for compatiable issues, refer to glibc
-    if(!fread(tmp_ehdr, sizeof(Elf64_Ehdr), 1, lib->fs))
+    //how much address space the PT_LOADs span, same as what mapSegment will return
+    Elf64_Addr first = -1ul, last = 0;
+    int pagesize = getpagesize();
+    for(Elf64_Phdr *ph = phdr; ph < &phdr[phnum]; ph++)
     {
-        fprintf(stderr, "mapLibrary error: cannot read ELF header of file %s", lib->name);
-        exit(-1);
+        if(ph->p_type != PT_LOAD)
+            continue;
+        if(first == -1ul)
+            first = ALIGN_DOWN(ph->p_vaddr, pagesize);
+        last = ph->p_vaddr + ph->p_memsz;
     }
+    return ALIGN_UP(last - first, pagesize);
+}
 
-    //get the elf header, now to read the program header
-    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)tmp_ehdr;
-    uint16_t phnum = ehdr->e_phnum;
-    uint64_t phoff = ehdr->e_phoff;
-    uint64_t phlen = phnum * sizeof(Elf64_Phdr);
-    Elf64_Phdr *phdr = malloc(phlen);
-    if(!fread(phdr, phlen, 1, lib->fs))
+static uint64_t mapWorker(Library *lib, void *addr, Library **tail, struct mapPipeline *pipe, int mode)
+{
+    // fill in the infomation and allocate space for shared object specified by lib
+
+    //a pipelined dependency has its headers read already
+    if(!lib->phdr)
+        reportHeaderError(readHeaders(lib), lib, NULL);
+    Elf64_Phdr *phdr = lib->phdr;
+    uint16_t phnum = lib->phnum;
+    //with HUGE_TEXT, move the library up until its text starts on a huge page
+    uint64_t text_offset = 0, align = 0, skipped = 0;
+    if(mode & HUGE_TEXT)
+        align = textAlignment(phdr, phnum, &text_offset);
+    if(!addr)
+        addr = (void *)(align ? allocRangeAligned(mapLength(phdr, phnum), align, text_offset)
+                            : allocRange(mapLength(phdr, phnum)));
+    else if(align)
     {
-        fprintf(stderr, "mapLibrary error: cannot read ELF program header of file %s", lib->name);
-        exit(-1);
+        uint64_t base = ALIGN_UP((uint64_t)addr + text_offset, align) - text_offset;
+        skipped = base - (uint64_t)addr;
+        addr = (void *)base;
     }
+    lib->addr = (uint64_t)addr;
 
     //actually loading it into memory
+    TRACE_BEGIN(map_start);
     uint64_t maplength = mapSegment(lib, phdr, addr, phnum);
+    lib->maplength = maplength;
+    if(align)
+        promoteText(lib);
+    if(mode & PAGE_PROFILE)
+        pageProfileReplay(lib);
+    TRACE_END(lib, TRACE_MAP, map_start);
+    TRACE_COUNT(lib, TRACE_BYTES_MAPPED, maplength);
     //fill in dynamic sections
+    TRACE_BEGIN(dyn_start);
     fill_info(lib);
     setup_hash(lib);
+    //only now, addressToSymbol may come looking for the symbol table any time after this
+    if(!lib->fake)
+        addressIndexAdd(lib); //ld.so's dladdr knows the real fake objects
+    tlsRegister(lib);
+    TRACE_END(lib, TRACE_DYNAMIC, dyn_start);
     //inspect DT_NEEDED, and put them on the list
     Elf64_Dyn *dyn = lib->dyn;
     const char *strtab = (void *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr; //rebased string table for pointing runpath
-    const char *runpath = (lib->dyn_info[DT_RUNPATH])? strdup(lib->dyn_info[DT_RUNPATH]->d_un.d_val + strtab):NULL;
+    const char *runpath = (lib->dyn_info[DT_RUNPATH])? lib->dyn_info[DT_RUNPATH]->d_un.d_val + strtab:NULL;
+    const char *rpath = (lib->dyn_info[DT_RPATH])? lib->dyn_info[DT_RPATH]->d_un.d_val + strtab:NULL;
+    if(lib->dyn_info[DT_SONAME])
+        registerName(lib, lib->dyn_info[DT_SONAME]->d_un.d_val + strtab); //what DT_NEEDED of others say
     
     int nneeded = 0;
     //count how many needs are there
@@ -302,45 +585,56 @@ static uint64_t mapWorker(Library *lib, void *addr)
             nneeded++;
         dyn++;
     }
-    lib->search_list = malloc((nneeded + 1) * sizeof(Library *));
+    //self + deps + a NULL terminator for whoever walks it
+    lib->search_list = calloc(nneeded + 2, sizeof(Library *));
 
     dyn = lib->dyn;
+    int need_processed = 0, need_seen = 0;
     while(dyn->d_tag != DT_NULL)
     {
-        int need_processed = 0;
-        if(need_processed == nneeded)
+        if(need_seen == nneeded)
             break;
         if(dyn->d_tag == DT_NEEDED)
         {
+            need_seen++;
             //can't use index to access DT_NEEEDED for there could be many of them
             char *depname = strdup(dyn->d_un.d_val + strtab);
             Library *dep_addr = isLibraryOpen(depname);
-            if(!dep_addr)
+            if(!dep_addr && (mode & LAZY_LOAD) && !doFakeLoad(depname))
+            {
+                //left for the first import nobody loaded has, see lazyLoad.c. libc and ld.so are
+                //loaded anyway, by the time we get here
+                lazyDefer(lib, depname, rpath, runpath, mode);
+                free(depname);
+            }
+            else if(!dep_addr)
             {
                 //we encounter a shared object whose Library isn't set up
                 //put it on list and next call to maoWorker will fix it
-                FILE *dep_fs = openDep(depname, runpath);
-                if(dep_fs == NULL)
+                dep_addr = newLibrary(depname, mode);
+                dep_addr->refcount = 1; //held by lib
+                registerLibrary(dep_addr);
+                if(pipe)
+                    pipelineSubmit(pipe, dep_addr, rpath, runpath, lib->name);
+                else
                 {
-                    fprintf(stderr, "mapLibrary error: unable to open %s as a dependency of %s",
-                        depname, lib->name);
-                    //free(depname);
-                    exit(-1);
+                    dep_addr->fs = openDep(dep_addr, rpath, runpath);
+                    if(dep_addr->fs == NULL)
+                        reportHeaderError(HEADER_NO_FILE, dep_addr, lib->name);
                 }
-                dep_addr = calloc(sizeof(Library), 1);
-                dep_addr->name = depname;
-                dep_addr->fs = dep_fs;
                 lib->search_list[++need_processed] = dep_addr; //make room for search_list[0] by using ++n
 
-                openedTail->next = dep_addr;
-                openedTail = dep_addr;
+                (*tail)->next = dep_addr;
+                *tail = dep_addr;
                 dep_addr->next = NULL;
                 if(doFakeLoad(depname))
                     dep_addr->fake = 1;
             }
             else
             {
-                //we've opened it, so we just fill in the dependency list
+                //we've opened it, maybe in another chain, so we just fill in the dependency list
+                free(depname);
+                dep_addr->refcount++;
                 lib->search_list[++need_processed] = dep_addr;
             }
         }
@@ -348,6 +642,48 @@ static uint64_t mapWorker(Library *lib, void *addr)
     }
     //search self for symbols first
     lib->search_list[0] = lib;
-    return maplength;
+    lazyDeferDone(lib, need_processed + 1);
+    return skipped + maplength; //the next library goes after the gap we left too
     
 }
+
+Library *mapInstance(Library *src, void *addr)
+{
+    //one more copy of a mapped library: same headers and dependencies, fresh pages from the file.
+    //the caller relocates it, see openInstances. Call with the registry locked
+    Library *lib = newLibrary(strdup(src->name), 0);
+    int fd = dup(fileno(src->fs));
+    lib->fs = fd < 0 ? NULL : fdopen(fd, "rb");
+    if(!lib->fs)
+    {
+        fprintf(stderr, "mapLibrary error: cannot reopen %s for another instance\n", src->name);
+        exit(-1);
+    }
+    lib->phnum = src->phnum;
+    lib->file_offset = src->file_offset;
+    lib->phdr = malloc(src->phnum * sizeof(Elf64_Phdr));
+    memcpy(lib->phdr, src->phdr, src->phnum * sizeof(Elf64_Phdr));
+    if(!addr)
+        addr = (void *)allocRange(mapLength(lib->phdr, lib->phnum));
+    lib->addr = (uint64_t)addr;
+    lib->maplength = mapSegment(lib, lib->phdr, addr, lib->phnum);
+    fill_info(lib);
+    setup_hash(lib);
+    addressIndexAdd(lib); //after the symbol table is set up, like mapWorker
+    tlsRegister(lib); //a module of its own, with its own blocks
+
+    //the same dependencies, which now have one more user
+    int n = 0;
+    while(__atomic_load_n(&src->search_list[n], __ATOMIC_ACQUIRE))
+        n++;
+    int pending = src->lazy_deps ? lazyInherit(src, lib, n) : 0;
+    lib->search_list = calloc(n + pending + 1, sizeof(Library *));
+    lib->search_list[0] = lib;
+    for(int i = 1; i < n; i++)
+    {
+        lib->search_list[i] = src->search_list[i];
+        src->search_list[i]->refcount++;
+    }
+    lib->refcount = 1; //the caller's reference
+    return lib;
+}
@@ -0,0 +1,97 @@
+//libraries that don't have a path of their own: an image in memory, or a range of an open file like
+//a memfd or a packed artifact. mmap wants a file, so an image in memory is copied into a memfd once,
+//while a file range starting on a page boundary is mapped straight from that file, no copy at all
+#define _GNU_SOURCE //for memfd_create
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static libraryResolver imageResolver = NULL;
+static void *imageResolverArg = NULL;
+
+void setLibraryResolver(libraryResolver resolver, void *arg)
+{
+    imageResolver = resolver;
+    imageResolverArg = arg;
+}
+
+static int copyToMemfd(const char *name, const void *buf, uint64_t len)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0)
+        return -1;
+    for(uint64_t done = 0; done < len; )
+    {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if(n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    //nobody can change it under our mappings any more
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+FILE *openImage(Library *lib, const struct libraryImage *image)
+{
+    //a FILE of our own for lib, positioned at its ELF header, which is at lib->file_offset
+    uint64_t pagesize = getpagesize();
+    int fd;
+    lib->file_offset = 0;
+    if(image->fd < 0)
+        fd = copyToMemfd(lib->name, image->buf, image->len);
+    else if(image->offset % pagesize == 0)
+    {
+        //a new open file description, so reading the headers doesn't move the caller's offset
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", image->fd);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            fd = dup(image->fd); //no /proc, share the offset then
+        lib->file_offset = image->offset;
+    }
+    else
+    {
+        //mmap offsets are in pages, so this range has to go to a memfd of its own
+        uint64_t len = image->len;
+        struct stat st;
+        if(len == 0 && fstat(image->fd, &st) == 0 && (uint64_t)st.st_size > image->offset)
+            len = st.st_size - image->offset; //up to the end of the file
+        uint64_t start = image->offset - image->offset % pagesize;
+        uint64_t maplen = image->offset - start + len;
+        char *map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, image->fd, start);
+        if(map == MAP_FAILED)
+            return NULL;
+        fd = copyToMemfd(lib->name, map + (image->offset - start), len);
+        munmap(map, maplen);
+    }
+    if(fd < 0)
+        return NULL;
+    FILE *fs = fdopen(fd, "rb");
+    if(!fs)
+    {
+        close(fd);
+        return NULL;
+    }
+    fseek(fs, lib->file_offset, SEEK_SET);
+    return fs;
+}
+
+FILE *resolveImage(Library *lib)
+{
+    //what the caller's resolver has for lib, NULL to look for it the usual way
+    struct libraryImage image = {NULL, 0, -1, 0};
+    if(!imageResolver || !imageResolver(lib->name, imageResolverArg, &image))
+        return NULL;
+    return openImage(lib, &image);
+}
@@ -0,0 +1,142 @@
+//what a library costs in memory, per segment: bytes mapped, pages resident and pages privately dirty.
+//the dirty ones are split into those relocation wrote, the pages holding a relocation target of the
+//RELR, RELA or PLT tables (they'd be shared if the library were prelinked at this address), and the
+//rest, dirtied by the program itself. Page state comes from /proc/self/pagemap, mincore can't tell dirty
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define PAGEMAP_PRESENT (1ul << 63)
+#define PAGEMAP_SWAPPED (1ul << 62)
+#define PAGEMAP_FILE (1ul << 61) //a page cache page, clean as far as we're concerned
+
+extern int scopeOrder(Library *head, Library ***order);
+extern Library *libraryOf(void *library);
+
+static void markPage(Library *lib, uint8_t *targets, uint64_t addr)
+{
+    uint64_t page = (addr - lib->addr) / getpagesize();
+    if(addr >= lib->addr && addr - lib->addr < lib->maplength)
+        targets[page >> 3] |= 1 << (page & 7);
+}
+
+static void markRela(Library *lib, uint8_t *targets, int tag, int sztag)
+{
+    if(!lib->dyn_info[tag])
+        return;
+    Elf64_Rela *start = (void *)lib->dyn_info[tag]->d_un.d_ptr;
+    Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[sztag]->d_un.d_val);
+    for(Elf64_Rela *it = start; it < end; it++)
+        markPage(lib, targets, lib->addr + it->r_offset);
+}
+
+static uint8_t *relocTargets(Library *lib)
+{
+    //one bit per page of lib, set if relocation writes to it, lazy binding included
+    uint64_t pages = lib->maplength / getpagesize();
+    uint8_t *targets = calloc(pages / 8 + 1, 1);
+    markRela(lib, targets, DT_RELA, DT_RELASZ);
+    markRela(lib, targets, DT_JMPREL, DT_PLTRELSZ);
+    if(lib->dyn_info[DT_NUM + DT_RELR_NEW])
+    {
+        //decoded like relocRelr does
+        const Elf64_Xword *relr = (void *)lib->dyn_info[DT_NUM + DT_RELR_NEW]->d_un.d_ptr;
+        const Elf64_Xword *relr_end = (void *)((char *)relr + lib->dyn_info[DT_NUM + DT_RELRSZ_NEW]->d_un.d_val);
+        Elf64_Addr where = 0;
+        for(; relr < relr_end; relr++)
+        {
+            if((*relr & 1) == 0)
+            {
+                where = lib->addr + *relr;
+                markPage(lib, targets, where);
+                where += sizeof(Elf64_Addr);
+                continue;
+            }
+            for(Elf64_Xword bits = *relr >> 1; bits; bits &= bits - 1)
+                markPage(lib, targets, where + __builtin_ctzll(bits) * sizeof(Elf64_Addr));
+            where += 63 * sizeof(Elf64_Addr);
+        }
+    }
+    return targets;
+}
+
+int memoryUsage(void *library, struct segmentUsage *usage, int max)
+{
+    Library *lib = libraryOf(library);
+    if(lib->fake || !lib->nsegs)
+        return 0; //mapped by ld.so, not us
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    if(pagemap < 0)
+        return -1;
+    uint64_t pagesize = getpagesize();
+    uint8_t *targets = relocTargets(lib);
+    int n = 0;
+    for(; n < lib->nsegs && n < max; n++)
+    {
+        struct segment *seg = &lib->segs[n];
+        struct segmentUsage *u = &usage[n];
+        memset(u, 0, sizeof(struct segmentUsage));
+        u->start = (void *)seg->start;
+        u->mapped = seg->end - seg->start;
+        u->prot = seg->prot;
+        uint64_t first = seg->start / pagesize, count = u->mapped / pagesize;
+        uint64_t *entries = malloc(count * sizeof(uint64_t) + 1);
+        if(pread(pagemap, entries, count * sizeof(uint64_t), first * sizeof(uint64_t)) != (ssize_t)(count * sizeof(uint64_t)))
+            count = 0;
+        for(uint64_t p = 0; p < count; p++)
+        {
+            if(entries[p] & PAGEMAP_PRESENT)
+                u->resident++;
+            //private pages are anonymous ones, COW copies and .bss, present or swapped out
+            if(!(entries[p] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) || (entries[p] & PAGEMAP_FILE))
+                continue;
+            u->dirty++;
+            uint64_t page = first + p - lib->addr / pagesize;
+            if(targets[page >> 3] & (1 << (page & 7)))
+                u->reloc_dirty++;
+            else
+                u->program_dirty++;
+        }
+        free(entries);
+    }
+    free(targets);
+    close(pagemap);
+    return n;
+}
+
+void memoryReport(void *library, FILE *out)
+{
+    //the library and everything in its scope, one line per segment and a total per library
+    Library **order;
+    int n = scopeOrder(libraryOf(library), &order);
+    unsigned long pagekb = getpagesize() >> 10;
+    fprintf(out, "%-40s %4s %10s %10s %10s %10s %10s\n", "library", "prot", "mapped kB", "rss kB", "dirty kB",
+        "reloc kB", "program kB");
+    for(int i = 0; i < n; i++)
+    {
+        Library *lib = order[i];
+        if(lib->fake)
+            continue;
+        struct segmentUsage usage[lib->nsegs + 1], total = {0};
+        int nsegs = memoryUsage(lib, usage, lib->nsegs);
+        for(int s = 0; s < nsegs; s++)
+        {
+            struct segmentUsage *u = &usage[s];
+            fprintf(out, "%-40s %c%c%c  %10lu %10lu %10lu %10lu %10lu\n", s ? "" : lib->name,
+                u->prot & 1 ? 'r' : '-', u->prot & 2 ? 'w' : '-', u->prot & 4 ? 'x' : '-', u->mapped >> 10,
+                u->resident * pagekb, u->dirty * pagekb, u->reloc_dirty * pagekb, u->program_dirty * pagekb);
+            total.mapped += u->mapped;
+            total.resident += u->resident;
+            total.dirty += u->dirty;
+            total.reloc_dirty += u->reloc_dirty;
+            total.program_dirty += u->program_dirty;
+        }
+        fprintf(out, "%-40s %4s %10lu %10lu %10lu %10lu %10lu\n", "", "all", total.mapped >> 10,
+            total.resident * pagekb, total.dirty * pagekb, total.reloc_dirty * pagekb, total.program_dirty * pagekb);
+    }
+    free(order);
+}
@@ -1,35 +1,81 @@
 // offer the same functionality with dlopen, but with an exact load address
 
 #include "library.h"
+#include "dl-rebuild.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> //TODO: use small inline functions to clobber those heavy libc implementations
 
-extern void *mapLibrary(const char *name, void *addr);
-extern void relocLibrary(Library *l, int mode);
+extern void *mapLibraryImage(const char *name, const struct libraryImage *image, void *addr, int mode, int *reused);
+extern void relocChain(Library *head, int mode);
+extern void scopeIndexBuild(Library *head);
+extern int imageCacheLoad(Library *head, int mode);
+extern void imageCacheStore(Library *head, int mode);
+extern void* isLibraryOpen(const char *name);
+extern void lockRegistry(void);
+extern void unlockRegistry(void);
 
-//a decent dynamic linker should prevent user from opening twice
-//in ld.so there is a global scope and a local scope, and I only maintain a scope when mapping
-/* 
-Library *openList = NULL;
-static void* isLibraryOpen(const char *name)
+static void *openImageOrFile(const char *name, const struct libraryImage *image, int mode, void *addr)
 {
-    Library *search = openList;
-    while (search)
+    //mapping and the registry are one thread at a time, but relocation, the expensive part,
+    //only locks the library being relocated, so threads opening different libraries overlap there.
+    //whoever finds a library somebody else is still relocating waits for it in relocChain, but never with the
+    //registry held: the one relocating may need the registry to get done (LAZY_LOAD, see loadOne)
+    lockRegistry();
+    //a decent dynamic linker should prevent user from opening twice
+    Library *old = isLibraryOpen(name);
+    int reused = 0;
+    Library *new = old ? NULL : mapLibraryImage(name, image, addr, mode, &reused); //map a shared object and its dependencies
+    if(reused)
+        old = new; //the same file under another name
+    if(old)
     {
-        if(strcmp(name, search->name) == 0)
-            return search;
-        search = search->next;
+        old->refcount++; //our reference keeps it around once the registry is unlocked
+        unlockRegistry();
+        if(!old->relocated && !old->fake)
+        {
+            relocChain(old, mode); //so far it was only somebody's dependency, or somebody is still at it
+            TRACE_REPORT(old, "open");
+        }
+        return old;
     }
-    return NULL;
-} 
-*/
+
+    if((mode & IMAGE_CACHE) && imageCacheLoad(new, mode))
+    {
+        unlockRegistry(); //nobody could see the chain before, it's relocated now
+        return new; //pre-relocated pages are in place, nothing to resolve
+    }
+    if(mode & SCOPE_INDEX)
+    {
+        TRACE_BEGIN(scope_start);
+        scopeIndexBuild(new); //one table for the whole chain, built before any import is resolved
+        TRACE_END(new, TRACE_SCOPE, scope_start);
+    }
+    unlockRegistry();
+    relocChain(new, mode); //relocate a shared object and its dependencies
+    if(mode & IMAGE_CACHE)
+        imageCacheStore(new, mode);
+    for(Library *lib = new; lib; lib = lib->next)
+        TRACE_REPORT(lib, "open"); //the whole chain this call mapped
+
+
+    return new;
+}
 
 void *openLibrary(const char *name, int mode, void *addr)
 {
-    Library *new = mapLibrary(name, addr); //map a shared object and its dependencies
-    relocLibrary(new, mode); //relocate a shared object and its dependencies
+    return openImageOrFile(name, NULL, mode, addr);
+}
 
+void *openLibraryFromMemory(const void *buf, unsigned long len, const char *name, int mode, void *addr)
+{
+    struct libraryImage image = {buf, len, -1, 0};
+    return openImageOrFile(name, &image, mode, addr);
+}
 
-    return new;
+void *openLibraryFromFd(int fd, unsigned long offset, const char *name, int mode, void *addr)
+{
+    struct libraryImage image = {NULL, 0, fd, offset};
+    return openImageOrFile(name, &image, mode, addr);
 }
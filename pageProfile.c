@@ -0,0 +1,204 @@
+//which pages of a library a warmed up process has touched, so the next openLibrary faults them all in
+//at once (PAGE_PROFILE) instead of one by one during its first requests.
+//pageProfileSave reads our page table from /proc/self/pagemap, mincore would only say what's in the
+//page cache. The profile goes next to the file as <file>.pages, or to the cache directory of imageCache
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h> //for offsetof
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PROFILE_MAGIC 0x50474450 //"PDGP"
+#define PROFILE_VERSION 1
+#define PAGEMAP_PRESENT (1ul << 63)
+#define PAGEMAP_SWAPPED (1ul << 62)
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 //linux 5.14, older elf headers don't have it
+#endif
+
+//the profile is only good for the very same file
+struct profileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dev, ino, size, mtime_sec, mtime_nsec;
+    uint64_t nranges;
+};
+
+//pages [start, end) from the load address, in pages
+struct profileRange
+{
+    uint64_t start, end;
+};
+
+extern int scopeOrder(Library *head, Library ***order);
+extern Library *libraryOf(void *library);
+extern int cacheDirectory(char *dir, size_t len);
+extern FILE *openCacheFile(const char *path, uid_t owner);
+extern int createCacheFile(const char *path, mode_t mode);
+
+static int fileIdentity(Library *lib, struct profileHeader *hdr)
+{
+    struct stat st;
+    if(!lib->fs || fstat(fileno(lib->fs), &st) < 0)
+        return -1;
+    memset(hdr, 0, sizeof(struct profileHeader));
+    hdr->magic = PROFILE_MAGIC;
+    hdr->version = PROFILE_VERSION;
+    hdr->dev = st.st_dev;
+    hdr->ino = st.st_ino;
+    hdr->size = st.st_size;
+    hdr->mtime_sec = st.st_mtim.tv_sec;
+    hdr->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static int profilePath(Library *lib, int beside, char *path, size_t len)
+{
+    //beside the file it was loaded from, or in the cache directory keyed like imageCache does
+    struct profileHeader id;
+    if(fileIdentity(lib, &id) < 0)
+        return -1;
+    int n;
+    if(beside)
+    {
+        char proc[64], file[4096];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fileno(lib->fs));
+        ssize_t flen = readlink(proc, file, sizeof(file) - 1);
+        if(flen <= 0 || file[0] != '/' || lib->file_offset)
+            return -1; //a memfd or part of a bigger file, there's nothing to put it next to
+        file[flen] = '\0';
+        n = snprintf(path, len, "%s.pages", file);
+    }
+    else
+    {
+        char dir[4096];
+        if(cacheDirectory(dir, sizeof(dir)) < 0)
+            return -1;
+        n = snprintf(path, len, "%s/%lx-%lx.pages", dir, id.dev, id.ino);
+    }
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static uint64_t touchedPages(Library *lib, int pagemap, struct profileRange **out)
+{
+    //runs of pages of lib's segments that are in our page table, or swapped out of it
+    uint64_t pagesize = getpagesize(), n = 0, cap = 16;
+    struct profileRange *ranges = malloc(cap * sizeof(struct profileRange));
+    for(int i = 0; i < lib->nsegs; i++)
+    {
+        uint64_t first = lib->segs[i].start / pagesize, count = (lib->segs[i].end - lib->segs[i].start) / pagesize;
+        uint64_t *entries = malloc(count * sizeof(uint64_t));
+        if(pread(pagemap, entries, count * sizeof(uint64_t), first * sizeof(uint64_t)) != (ssize_t)(count * sizeof(uint64_t)))
+            count = 0;
+        for(uint64_t p = 0; p < count; p++)
+        {
+            if(!(entries[p] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)))
+                continue;
+            uint64_t page = first + p - lib->addr / pagesize;
+            if(n && ranges[n - 1].end == page)
+            {
+                ranges[n - 1].end++;
+                continue;
+            }
+            if(n == cap)
+                ranges = realloc(ranges, (cap *= 2) * sizeof(struct profileRange));
+            ranges[n++] = (struct profileRange){page, page + 1};
+        }
+        free(entries);
+    }
+    *out = ranges;
+    return n;
+}
+
+static int saveOne(Library *lib, int pagemap)
+{
+    struct profileHeader hdr;
+    struct profileRange *ranges;
+    if(fileIdentity(lib, &hdr) < 0)
+        return -1;
+    hdr.nranges = touchedPages(lib, pagemap, &ranges);
+
+    //written aside and renamed, so a process loading it meanwhile never sees half a profile
+    int ok = -1;
+    for(int beside = 1; beside >= 0 && ok < 0; beside--)
+    {
+        char path[4096], tmp[4096 + 32];
+        if(profilePath(lib, beside, path, sizeof(path)) < 0)
+            continue;
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+        int fd = createCacheFile(tmp, beside ? 0644 : 0600);
+        FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
+        if(!f)
+        {
+            if(fd >= 0)
+                close(fd);
+            continue;
+        }
+        ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(ranges, sizeof(struct profileRange), hdr.nranges, f) == hdr.nranges) ? 0 : -1;
+        ok = (fclose(f) == 0 && ok == 0) ? rename(tmp, path) : -1;
+        if(ok < 0)
+            unlink(tmp);
+    }
+    free(ranges);
+    return ok;
+}
+
+int pageProfileSave(void *library)
+{
+    //the library and everything in its scope, objects ld.so loaded for us are its business
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    if(pagemap < 0)
+        return -1;
+    Library **order;
+    int n = scopeOrder(libraryOf(library), &order), ok = 0;
+    for(int i = 0; i < n; i++)
+        if(!order[i]->fake && saveOne(order[i], pagemap) < 0)
+            ok = -1;
+    free(order);
+    close(pagemap);
+    return ok;
+}
+
+void pageProfileReplay(Library *lib)
+{
+    //right after mapSegment, so relocation finds its pages in place too
+    struct profileHeader want, hdr;
+    if(fileIdentity(lib, &want) < 0)
+        return;
+    //the one next to the library may also be its owner's, who could change the library anyway
+    struct stat st;
+    if(fstat(fileno(lib->fs), &st) < 0)
+        return;
+    FILE *f = NULL;
+    char path[4096];
+    for(int beside = 1; beside >= 0 && !f; beside--)
+        if(profilePath(lib, beside, path, sizeof(path)) == 0)
+            f = openCacheFile(path, beside ? st.st_uid : getuid());
+    if(!f)
+        return; //no profile yet, this run is the warm-up
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(&hdr, &want, offsetof(struct profileHeader, nranges)) != 0)
+    {
+        fclose(f); //a rebuilt library, the profile is of no use
+        return;
+    }
+    uint64_t pagesize = getpagesize(), pages = lib->maplength / pagesize;
+    struct profileRange r;
+    for(uint64_t i = 0; i < hdr.nranges && fread(&r, sizeof(r), 1, f) == 1; i++)
+    {
+        if(r.start >= r.end || r.end > pages)
+            continue;
+        void *start = (void *)(lib->addr + r.start * pagesize);
+        uint64_t len = (r.end - r.start) * pagesize;
+        //fault them in now, or at least start reading them on kernels without MADV_POPULATE_READ
+        if(madvise(start, len, MADV_POPULATE_READ) < 0)
+            madvise(start, len, MADV_WILLNEED);
+    }
+    fclose(f);
+}
@@ -0,0 +1,312 @@
+//find the file of a library the way ld.so does, but remember every directory we've looked into
+//so resolving N dependencies takes about N opens instead of N times the number of search paths.
+//a name missing from every listing makes us stat the directories and list the changed ones again
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define LD_SO_CACHE "/etc/ld.so.cache"
+#define CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+
+/* see glibc sysdeps/generic/dl-cache.h */
+#define FLAG_TYPE_MASK 0x00ff
+#define FLAG_ELF_LIBC6 0x0003
+#define FLAG_REQUIRED_MASK 0xff00
+#define FLAG_X8664_LIB64 0x0300
+
+static const char *sys_path[] = {
+    "/usr/lib/x86_64-linux-gnu/",
+    "/lib/x86_64-linux-gnu/",
+    ""
+};
+
+struct cacheFileNew
+{
+    char magic[sizeof(CACHE_MAGIC_NEW) - 1];
+    uint32_t nlibs;
+    uint32_t len_strings;
+    uint8_t flags;
+    uint8_t padding[3];
+    uint32_t extension_offset;
+    uint32_t unused[3];
+};
+
+struct cacheEntryNew
+{
+    int32_t flags;
+    uint32_t key, value; //offsets from the start of the cache
+    uint32_t osversion;
+    uint64_t hwcap;
+};
+
+//a string-keyed open-addressed table, used both as a set (directory listing) and a map (ld.so.cache)
+struct nameTable
+{
+    const char **keys;
+    const char **vals;
+    uint32_t mask, used;
+};
+
+static uint32_t nameSlot(struct nameTable *t, const char *key)
+{
+    uint32_t i = dl_new_hash(key) & t->mask;
+    while(t->keys[i] && strcmp(t->keys[i], key) != 0)
+        i = (i + 1) & t->mask;
+    return i;
+}
+
+static void nameInsert(struct nameTable *t, const char *key, const char *val)
+{
+    if(!t->keys || (t->used + 1) * 2 > t->mask + 1)
+    {
+        //double when half full
+        struct nameTable old = *t;
+        uint32_t cap = old.keys ? (old.mask + 1) * 2 : 64;
+        t->keys = calloc(cap, sizeof(char *));
+        t->vals = calloc(cap, sizeof(char *));
+        t->mask = cap - 1;
+        for(uint32_t i = 0; old.keys && i <= old.mask; i++)
+        {
+            if(!old.keys[i])
+                continue;
+            uint32_t slot = nameSlot(t, old.keys[i]);
+            t->keys[slot] = old.keys[i];
+            t->vals[slot] = old.vals[i];
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    uint32_t slot = nameSlot(t, key);
+    if(t->keys[slot])
+        return; //first one wins
+    t->keys[slot] = key;
+    t->vals[slot] = val;
+    t->used++;
+}
+
+static const char *nameFind(struct nameTable *t, const char *key, int *found)
+{
+    *found = 0;
+    if(!t->keys)
+        return NULL;
+    uint32_t slot = nameSlot(t, key);
+    *found = t->keys[slot] != NULL;
+    return t->vals[slot];
+}
+
+//what we know about a search directory, a missing directory has no names at all
+struct dirInfo
+{
+    char *path;
+    struct nameTable names;
+    struct timespec mtime; //of the directory when listed, zero if it was missing
+    int racy; //changed too close to the listing for mtime to tell, see listDir
+    struct dirInfo *next;
+};
+
+//pipelined mapping resolves in parallel. The lock covers the listings and ld.so.cache only, files are
+//opened outside it so map workers don't wait on each other's I/O
+static pthread_mutex_t resolverLock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirInfo *dirs = NULL;
+static struct nameTable ldCache;
+static int ldCacheLoaded = 0;
+
+static void loadLdCache(void)
+{
+    //mmap /etc/ld.so.cache once and index the x86-64 entries by soname
+    ldCacheLoaded = 1;
+    int fd = open(LD_SO_CACHE, O_RDONLY);
+    if(fd < 0)
+        return;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cacheFileNew))
+    {
+        close(fd);
+        return;
+    }
+    const char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED)
+        return;
+
+    const char *start = file;
+    if(memcmp(file, CACHE_MAGIC_OLD, sizeof(CACHE_MAGIC_OLD) - 1) == 0)
+    {
+        //old format first, the new one follows its 12-byte entries, 8-byte aligned
+        uint32_t nold = *(uint32_t *)(file + sizeof(CACHE_MAGIC_OLD) - 1);
+        uint64_t skip = sizeof(CACHE_MAGIC_OLD) - 1 + sizeof(uint32_t) + nold * 3 * sizeof(int32_t);
+        start = file + ((skip + 7) & ~7ul);
+    }
+    const struct cacheFileNew *hdr = (const void *)start;
+    if((const char *)(hdr + 1) > file + st.st_size
+        || memcmp(hdr->magic, CACHE_MAGIC_NEW, sizeof(CACHE_MAGIC_NEW) - 1) != 0)
+        return; //not something we understand, just go without it
+
+    const struct cacheEntryNew *entries = (const void *)(hdr + 1);
+    if((const char *)(entries + hdr->nlibs) > file + st.st_size)
+        return;
+    for(uint32_t i = 0; i < hdr->nlibs; i++)
+    {
+        const struct cacheEntryNew *e = &entries[i];
+        if((e->flags & FLAG_TYPE_MASK) != FLAG_ELF_LIBC6 || (e->flags & FLAG_REQUIRED_MASK) != FLAG_X8664_LIB64)
+            continue;
+        if(e->key >= st.st_size || e->value >= st.st_size)
+            continue;
+        //new format offsets count from the start of the file
+        nameInsert(&ldCache, file + e->key, file + e->value);
+    }
+}
+
+static int dirChanged(struct dirInfo *d, struct timespec *mtime)
+{
+    //stat the directory again, mtime moves whenever a name is added or removed
+    struct stat st;
+    if(stat(*d->path ? d->path : ".", &st) < 0 || !S_ISDIR(st.st_mode))
+        memset(mtime, 0, sizeof(struct timespec));
+    else
+        *mtime = st.st_mtim;
+    return d->racy || mtime->tv_sec != d->mtime.tv_sec || mtime->tv_nsec != d->mtime.tv_nsec;
+}
+
+static void listDir(struct dirInfo *d)
+{
+    //(re)read the names of d. A directory changed within the last second may change again without its
+    //mtime moving on a filesystem with coarse timestamps, so it's listed again next time too, like git does
+    for(uint32_t i = 0; d->names.keys && i <= d->names.mask; i++)
+        free((char *)d->names.keys[i]);
+    free(d->names.keys);
+    free(d->names.vals);
+    memset(&d->names, 0, sizeof(struct nameTable));
+    struct timespec now;
+    dirChanged(d, &d->mtime);
+    clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = d->mtime.tv_sec && now.tv_sec <= d->mtime.tv_sec + 1;
+    DIR *dir = opendir(*d->path ? d->path : ".");
+    if(dir)
+    {
+        struct dirent *ent;
+        while((ent = readdir(dir)))
+            nameInsert(&d->names, strdup(ent->d_name), NULL);
+        closedir(dir);
+    }
+}
+
+static struct dirInfo *lookDir(const char *path)
+{
+    //list a directory the first time it's searched, a missing one is remembered too
+    for(struct dirInfo *d = dirs; d; d = d->next)
+        if(strcmp(d->path, path) == 0)
+            return d;
+    struct dirInfo *d = calloc(1, sizeof(struct dirInfo));
+    d->path = strdup(path);
+    listDir(d);
+    d->next = dirs;
+    dirs = d;
+    return d;
+}
+
+static int refreshDirs(void)
+{
+    //list again every directory that changed since we last did, 1 if any did
+    int changed = 0;
+    for(struct dirInfo *d = dirs; d; d = d->next)
+    {
+        struct timespec mtime;
+        if(!dirChanged(d, &mtime))
+            continue;
+        listDir(d);
+        changed = 1;
+    }
+    return changed;
+}
+
+static FILE *tryDir(const char *dir, const char *name, uint64_t *probes)
+{
+    //open dir/name only if the directory listing says it's there
+    int found;
+    pthread_mutex_lock(&resolverLock);
+    nameFind(&lookDir(dir)->names, name, &found);
+    pthread_mutex_unlock(&resolverLock);
+    (*probes)++;
+    if(!found)
+        return NULL;
+    char path[PATH_MAX];
+    size_t len = strlen(dir);
+    if(snprintf(path, sizeof(path), "%s%s%s", dir, (len && dir[len - 1] != '/') ? "/" : "", name) >= (int)sizeof(path))
+        return NULL;
+    (*probes)++;
+    return fopen(path, "rb");
+}
+
+static FILE *tryPathList(const char *list, const char *name, uint64_t *probes)
+{
+    //a colon separated list like LD_LIBRARY_PATH or DT_RUNPATH
+    if(!list)
+        return NULL;
+    char *xpath = strdup(list);
+    char *p, *last;
+    FILE *curr = NULL;
+    for((p = strtok_r(xpath, ":", &last)); p && !curr; p = strtok_r(NULL, ":", &last))
+        curr = tryDir(p, name, probes);
+    free(xpath);
+    return curr;
+}
+
+static FILE *searchLibrary(const char *name, const char *rpath, const char *runpath, uint64_t *probes)
+{
+    //same order as ld.so: DT_RPATH unless there's DT_RUNPATH, LD_LIBRARY_PATH, DT_RUNPATH, ld.so.cache, default dirs
+    FILE *curr = NULL;
+    if(!runpath)
+        curr = tryPathList(rpath, name, probes);
+    if(!curr)
+        curr = tryPathList(getenv("LD_LIBRARY_PATH"), name, probes);
+    if(!curr)
+        curr = tryPathList(runpath, name, probes);
+    if(!curr)
+    {
+        int found;
+        pthread_mutex_lock(&resolverLock);
+        if(!ldCacheLoaded)
+            loadLdCache();
+        const char *path = nameFind(&ldCache, name, &found); //points into the mapped cache, which stays
+        pthread_mutex_unlock(&resolverLock);
+        if(found)
+        {
+            (*probes)++;
+            curr = fopen(path, "rb");
+        }
+    }
+    for(const char **s = sys_path; **s && !curr; s++)
+        curr = tryDir(*s, name, probes);
+    return curr;
+}
+
+FILE *resolveLibrary(const char *name, const char *rpath, const char *runpath, uint64_t *probes)
+{
+    //probes counts directories looked into and files opened
+    // go for it if it's an absolute path
+    if(strchr(name, '/'))
+    {
+        (*probes)++;
+        return fopen(name, "rb");
+    }
+
+    FILE *curr = searchLibrary(name, rpath, runpath, probes);
+    if(curr)
+        return curr;
+    //the listings may predate the library, only a miss pays for checking them
+    pthread_mutex_lock(&resolverLock);
+    int changed = refreshDirs();
+    pthread_mutex_unlock(&resolverLock);
+    return changed ? searchLibrary(name, rpath, runpath, probes) : NULL;
+}
@@ -0,0 +1,227 @@
+//count the calls going through each PLT slot, by pointing the GOT at a tiny per-slot stub
+//that bumps a counter and jumps on to the real target. Switching it off puts the real
+//targets back into the GOT, so a library that isn't being profiled pays nothing
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <x86intrin.h> //for __rdtsc
+
+#define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
+#define ALIGN_UP(base, size) ALIGN_DOWN((base) + (size)-1, (size))
+
+#define STUB_SIZE 48
+#define SAMPLE_MASK 1023 //time one call out of 1024
+#define SHADOW_DEPTH 64 //timed calls nested deeper than this are counted but not timed
+
+struct pltSlot
+{
+    uint64_t calls;
+    uint64_t cycles; //summed over the sampled calls only
+    uint64_t sampled;
+    Elf64_Addr target; //0 until the slot is bound
+    Elf64_Addr timed_entry; //pltProfileTimed, read by the stub through its own slot
+    const char *name;
+};
+
+struct pltProfile
+{
+    void *stubs; //STUB_SIZE bytes of code per slot, read-only and executable
+    uint64_t stubs_len;
+    struct pltSlot *slots;
+    uint64_t nslots;
+    int enabled;
+};
+
+//timing state of the sampled calls in flight on this thread
+struct shadowFrame
+{
+    Elf64_Addr ret;
+    struct pltSlot *slot;
+    uint64_t start;
+};
+static __thread struct shadowFrame shadowStack[SHADOW_DEPTH];
+static __thread int shadowTop;
+
+extern void pltProfileTimed(void);
+extern void pltProfileReturn(void);
+extern Library *libraryOf(void *library);
+
+static uint8_t *emit(uint8_t *p, const void *bytes, int n)
+{
+    memcpy(p, bytes, n);
+    return p + n;
+}
+
+static uint8_t *emitRel32(uint8_t *p, void *target)
+{
+    //rip relative displacement, counted from the end of the instruction it closes
+    int32_t disp = (int32_t)((uint8_t *)target - (p + 4));
+    memcpy(p, &disp, 4);
+    return p + 4;
+}
+
+static void emitStub(uint8_t *p, struct pltSlot *slot, int timed)
+{
+    if(!timed)
+    {
+        //lock incq calls(%rip); jmp *target(%rip)
+        p = emit(p, "\xf0\x48\xff\x05", 4);
+        p = emitRel32(p, &slot->calls);
+        p = emit(p, "\xff\x25", 2);
+        emitRel32(p, &slot->target);
+        return;
+    }
+    //mov $1, %r11; lock xadd %r11, calls(%rip); test $SAMPLE_MASK, %r11d; jz 1f
+    //jmp *target(%rip)
+    //1: lea slot(%rip), %r11; jmp *timed_entry(%rip)
+    p = emit(p, "\x49\xc7\xc3\x01\x00\x00\x00", 7);
+    p = emit(p, "\xf0\x4c\x0f\xc1\x1d", 5);
+    p = emitRel32(p, &slot->calls);
+    uint32_t mask = SAMPLE_MASK;
+    p = emit(p, "\x41\xf7\xc3", 3);
+    p = emit(p, &mask, 4);
+    p = emit(p, "\x74\x06", 2);
+    p = emit(p, "\xff\x25", 2);
+    p = emitRel32(p, &slot->target);
+    p = emit(p, "\x4c\x8d\x1d", 3);
+    p = emitRel32(p, slot);
+    p = emit(p, "\xff\x25", 2);
+    emitRel32(p, &slot->timed_entry);
+}
+
+void pltProfileSetup(Library *lib, int mode)
+{
+    //one stub and one counter per entry of .rela.plt
+    if(lib->plt_profile || !lib->dyn_info[DT_JMPREL])
+        return;
+    uint64_t nslots = lib->dyn_info[DT_PLTRELSZ]->d_un.d_val / sizeof(Elf64_Rela);
+    uint64_t pagesize = getpagesize();
+    uint64_t stubs_len = ALIGN_UP(nslots * STUB_SIZE, pagesize);
+    uint64_t slots_len = ALIGN_UP(nslots * sizeof(struct pltSlot), pagesize);
+    //code and counters in one mapping, so every rip relative displacement fits in 32 bits
+    uint8_t *mem = mmap(NULL, stubs_len + slots_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        fprintf(stderr, "pltProfile error: cannot allocate stubs for %s\n", lib->name);
+        exit(-1);
+    }
+
+    struct pltProfile *prof = calloc(1, sizeof(struct pltProfile));
+    prof->stubs = mem;
+    prof->stubs_len = stubs_len + slots_len;
+    prof->slots = (struct pltSlot *)(mem + stubs_len);
+    prof->nslots = nslots;
+    prof->enabled = 1;
+
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+    Elf64_Rela *plt = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+    for(uint64_t i = 0; i < nslots; i++)
+    {
+        struct pltSlot *slot = &prof->slots[i];
+        slot->name = strtab + symtab[ELF64_R_SYM(plt[i].r_info)].st_name;
+        slot->timed_entry = (Elf64_Addr)&pltProfileTimed;
+        emitStub(mem + i * STUB_SIZE, slot, (mode & PLT_PROFILE_CYCLES) == PLT_PROFILE_CYCLES);
+    }
+    mprotect(mem, stubs_len, PROT_READ | PROT_EXEC);
+    lib->plt_profile = prof;
+}
+
+Elf64_Addr pltProfileBind(Library *lib, uint64_t index, Elf64_Addr target)
+{
+    //slot `index` now resolves to `target`, returns what the GOT should hold
+    struct pltProfile *prof = lib->plt_profile;
+    if(index >= prof->nslots)
+        return target;
+    __atomic_store_n(&prof->slots[index].target, target, __ATOMIC_RELEASE);
+    if(!prof->enabled)
+        return target;
+    return (Elf64_Addr)prof->stubs + index * STUB_SIZE;
+}
+
+void pltProfileSwitch(void *library, int on)
+{
+    //point every bound GOT entry at its stub, or back at its target
+    Library *lib = libraryOf(library);
+    struct pltProfile *prof = lib->plt_profile;
+    if(!prof)
+        return;
+    prof->enabled = on;
+    Elf64_Rela *plt = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+    for(uint64_t i = 0; i < prof->nslots; i++)
+    {
+        Elf64_Addr target = __atomic_load_n(&prof->slots[i].target, __ATOMIC_ACQUIRE);
+        if(!target)
+            continue; //still lazy, runtimeResolve will pick the right one
+        Elf64_Addr *got = (void *)(lib->addr + plt[i].r_offset);
+        __atomic_store_n(got, on ? (Elf64_Addr)prof->stubs + i * STUB_SIZE : target, __ATOMIC_RELEASE);
+    }
+}
+
+Elf64_Addr pltProfileEnter(struct pltSlot *slot, Elf64_Addr *retaddr)
+{
+    //a sampled call: start the clock and hijack the return so pltProfileExit sees the end
+    if(shadowTop == SHADOW_DEPTH)
+        return slot->target;
+    struct shadowFrame *f = &shadowStack[shadowTop++];
+    f->ret = *retaddr;
+    f->slot = slot;
+    *retaddr = (Elf64_Addr)&pltProfileReturn;
+    f->start = __rdtsc();
+    return slot->target;
+}
+
+Elf64_Addr pltProfileExit(void)
+{
+    uint64_t end = __rdtsc();
+    struct shadowFrame *f = &shadowStack[--shadowTop];
+    __atomic_fetch_add(&f->slot->cycles, end - f->start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->slot->sampled, 1, __ATOMIC_RELAXED);
+    return f->ret;
+}
+
+static int byCalls(const void *a, const void *b)
+{
+    const struct pltSlot *x = *(const struct pltSlot **)a, *y = *(const struct pltSlot **)b;
+    return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+void pltProfileReport(void *library, FILE *out)
+{
+    //every slot called at least once, hottest first
+    Library *lib = libraryOf(library);
+    struct pltProfile *prof = lib->plt_profile;
+    if(!prof)
+        return;
+    struct pltSlot **sorted = malloc(prof->nslots * sizeof(struct pltSlot *) + 1);
+    uint64_t n = 0;
+    for(uint64_t i = 0; i < prof->nslots; i++)
+        if(prof->slots[i].calls)
+            sorted[n++] = &prof->slots[i];
+    qsort(sorted, n, sizeof(struct pltSlot *), byCalls);
+    fprintf(out, "PLT profile of %s: %lu of %lu slots called\n", lib->name, n, prof->nslots);
+    fprintf(out, "%16s %16s  %s\n", "calls", "cycles/call", "symbol");
+    for(uint64_t i = 0; i < n; i++)
+    {
+        struct pltSlot *s = sorted[i];
+        if(s->sampled)
+            fprintf(out, "%16lu %16lu  %s\n", s->calls, s->cycles / s->sampled, s->name);
+        else
+            fprintf(out, "%16lu %16s  %s\n", s->calls, "-", s->name);
+    }
+    free(sorted);
+}
+
+void pltProfileRelease(Library *lib)
+{
+    struct pltProfile *prof = lib->plt_profile;
+    if(!prof)
+        return;
+    munmap(prof->stubs, prof->stubs_len);
+    free(prof);
+    lib->plt_profile = NULL;
+}
@@ -0,0 +1,173 @@
+//every Library alive in the process, whichever chain mapped it, and the names and files it's known by.
+//a library is found by the name it was opened with, by its DT_SONAME, and by whatever other name turned
+//out to be the same file, so a symlink or a second path never gets a file mapped twice.
+//both tables are hashed, openLibrary and closeLibrary hold registryLock while they look or change them
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//one key of a library: a name, or the file it was mapped from
+struct registryEntry
+{
+    char *name; //NULL in the file table
+    uint64_t dev, ino, offset; //offset too, two libraries can be packed in one file
+    uint32_t hash;
+    Library *lib;
+    struct registryEntry *next; //in its bucket
+    struct registryEntry *lib_next; //the other keys of lib
+};
+
+struct registryTable
+{
+    struct registryEntry **buckets;
+    uint32_t mask, used;
+};
+
+Library *loadedLibraries = NULL; //linked by loaded_next, for unregisterLibrary
+static struct registryTable byName, byFile;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+void lockRegistry(void)
+{
+    pthread_mutex_lock(&registryLock);
+}
+
+void unlockRegistry(void)
+{
+    pthread_mutex_unlock(&registryLock);
+}
+
+static uint32_t fileHash(uint64_t dev, uint64_t ino, uint64_t offset)
+{
+    uint64_t h = (ino * 0x9e3779b97f4a7c15ul) ^ (dev * 0xc2b2ae3d27d4eb4ful) ^ offset;
+    return h ^ (h >> 32);
+}
+
+static void tableInsert(struct registryTable *t, struct registryEntry *e)
+{
+    if(!t->buckets || t->used >= t->mask + 1)
+    {
+        //double when there are as many keys as buckets
+        uint32_t cap = t->buckets ? (t->mask + 1) * 2 : 64;
+        struct registryEntry **buckets = calloc(cap, sizeof(struct registryEntry *));
+        for(uint32_t i = 0; t->buckets && i <= t->mask; i++)
+        {
+            while(t->buckets[i])
+            {
+                struct registryEntry *moved = t->buckets[i];
+                t->buckets[i] = moved->next;
+                moved->next = buckets[moved->hash & (cap - 1)];
+                buckets[moved->hash & (cap - 1)] = moved;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->mask = cap - 1;
+    }
+    e->next = t->buckets[e->hash & t->mask];
+    t->buckets[e->hash & t->mask] = e;
+    t->used++;
+}
+
+static void tableRemove(struct registryTable *t, struct registryEntry *e)
+{
+    for(struct registryEntry **link = &t->buckets[e->hash & t->mask]; *link; link = &(*link)->next)
+    {
+        if(*link == e)
+        {
+            *link = e->next;
+            t->used--;
+            return;
+        }
+    }
+}
+
+void* isLibraryOpen(const char *name)
+{
+    if(!byName.buckets)
+        return NULL;
+    uint32_t hash = dl_new_hash(name);
+    for(struct registryEntry *e = byName.buckets[hash & byName.mask]; e; e = e->next)
+        if(e->hash == hash && strcmp(e->name, name) == 0)
+            return e->lib;
+    return NULL;
+}
+
+void registerName(Library *lib, const char *name)
+{
+    //one more name lib is known by, a name somebody else has already stays theirs
+    if(isLibraryOpen(name))
+        return;
+    struct registryEntry *e = calloc(1, sizeof(struct registryEntry));
+    e->name = strdup(name);
+    e->hash = dl_new_hash(name);
+    e->lib = lib;
+    e->lib_next = lib->registry_keys;
+    lib->registry_keys = e;
+    tableInsert(&byName, e);
+}
+
+void registerLibrary(Library *lib)
+{
+    //by its name for now, its file is only known once it's open, see registerFile
+    lib->loaded_next = loadedLibraries;
+    loadedLibraries = lib;
+    registerName(lib, lib->name);
+}
+
+static int fileIdentity(Library *lib, struct registryEntry *key)
+{
+    struct stat st;
+    if(!lib->fs || fstat(fileno(lib->fs), &st) < 0)
+        return -1;
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->offset = lib->file_offset;
+    key->hash = fileHash(key->dev, key->ino, key->offset);
+    return 0;
+}
+
+Library *registerFile(Library *lib)
+{
+    //remember the file lib was opened from, or return the library already mapped from that file
+    struct registryEntry key;
+    if(fileIdentity(lib, &key) < 0)
+        return NULL;
+    for(struct registryEntry *e = byFile.buckets ? byFile.buckets[key.hash & byFile.mask] : NULL; e; e = e->next)
+        if(e->hash == key.hash && e->ino == key.ino && e->dev == key.dev && e->offset == key.offset && e->lib != lib)
+            return e->lib;
+    struct registryEntry *e = malloc(sizeof(struct registryEntry));
+    *e = key;
+    e->name = NULL;
+    e->lib = lib;
+    e->lib_next = lib->registry_keys;
+    lib->registry_keys = e;
+    tableInsert(&byFile, e);
+    return NULL;
+}
+
+void unregisterLibrary(Library *lib)
+{
+    //drop lib and all its keys, and keep the chain it was mapped in walkable for the survivors
+    while(lib->registry_keys)
+    {
+        struct registryEntry *e = lib->registry_keys;
+        lib->registry_keys = e->lib_next;
+        tableRemove(e->name ? &byName : &byFile, e);
+        free(e->name);
+        free(e);
+    }
+    for(Library **link = &loadedLibraries; *link; link = &(*link)->loaded_next)
+    {
+        if(*link == lib)
+        {
+            *link = lib->loaded_next;
+            break;
+        }
+    }
+    for(Library *search = loadedLibraries; search; search = search->loaded_next)
+        if(search->next == lib)
+            search->next = lib->next;
+}
@@ -1,6 +1,7 @@
 //relocate shared object so that the symbols no longer hold a PIC address
 #include "library.h"
-#include <dlfcn.h> //turn to dlsym for help at fake load object
+#include "dl-rebuild.h" //for the mode bits
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,112 +9,235 @@
 #include <link.h> //TODO: get rid of this later
 #include <string.h>
 
-// glibc version to hash a symbol
-static uint_fast32_t
-dl_new_hash(const char *s)
+extern Elf64_Sym *hashLookup(Library *lib, const char *name);
+extern void *scopeLookup(struct scopeIndex *idx, const char *name);
+extern int epochEnter(void);
+extern void epochLeave(int parity);
+extern void *fakeLookup(Library *lib, const char *name);
+extern void relocParallel(Library *lib, Elf64_Rela *start, Elf64_Rela *end, relocRange fn, int nthreads);
+extern void pltProfileSetup(Library *lib, int mode);
+extern Elf64_Addr pltProfileBind(Library *lib, uint64_t index, Elf64_Addr target);
+extern void *tlsGetAddr(void *ti);
+extern void *tlsSymbolAddress(Library *lib, const Elf64_Sym *sym);
+extern void relocTls(Library *lib, Elf64_Rela *r);
+extern void *lazyLoadSymbol(Library *lib, const char *name);
+
+//the word relocSymbolic or relocJumpSlots is resolving on this thread, for deferIfunc
+struct relocSite
+{
+    Elf64_Addr *dest;
+    Elf64_Sxword addend;
+};
+
+//an IFUNC resolver that has to wait until the library it's in is relocated, it may read its GOT
+struct deferredIfunc
+{
+    Elf64_Addr *dest;
+    Elf64_Sxword addend;
+    Elf64_Addr resolver;
+    struct deferredIfunc *next;
+};
+
+static __thread struct relocSite *currentSite;
+static pthread_mutex_t ifuncLock = PTHREAD_MUTEX_INITIALIZER; //ifunc_pending of every library, and relocated with it
+
+static int deferIfunc(Library *dep, Elf64_Addr resolver)
 {
-    uint_fast32_t h = 5381;
-    for (unsigned char c = *s; c != '\0'; c = *++s)
-        h = h * 33 + c;
-    return h & 0xffffffff;
+    //dep is still being relocated, by the chain we're in or the one a LAZY_LOAD cycle came from:
+    //write down where the answer goes, finishRelocation calls the resolver. 0 if dep is done already
+    int deferred = 0;
+    pthread_mutex_lock(&ifuncLock);
+    if(!dep->relocated)
+    {
+        struct deferredIfunc *d = malloc(sizeof(struct deferredIfunc));
+        *d = (struct deferredIfunc){currentSite->dest, currentSite->addend, resolver, dep->ifunc_pending};
+        dep->ifunc_pending = d;
+        deferred = 1;
+    }
+    pthread_mutex_unlock(&ifuncLock);
+    return deferred;
+}
+
+static void finishRelocation(Library *lib)
+{
+    //mark lib relocated, then give everybody who bound to one of its IFUNCs meanwhile what the resolver says
+    pthread_mutex_lock(&ifuncLock);
+    __atomic_store_n(&lib->relocated, 1, __ATOMIC_RELEASE);
+    struct deferredIfunc *d = lib->ifunc_pending;
+    lib->ifunc_pending = NULL;
+    pthread_mutex_unlock(&ifuncLock);
+    while(d)
+    {
+        struct deferredIfunc *next = d->next;
+        *d->dest = ((Elf64_Addr(*)(void))d->resolver)() + d->addend;
+        free(d);
+        d = next;
+    }
 }
 
 void *symbolLookup(Library *dep, const char *name)
 {
     //find symbol `name` inside the symbol table of `dep`
     if(dep->fake)
+        return fakeLookup(dep, name);
+
+    Elf64_Sym *sym = hashLookup(dep, name);
+    if(sym && ELF64_ST_TYPE(sym->st_info) == STT_TLS)
+        return tlsSymbolAddress(dep, sym); //the copy of the calling thread
+    if(sym && ELF64_ST_TYPE(sym->st_info) == STT_GNU_IFUNC)
     {
-        void *handle = dlopen(dep->name, RTLD_LAZY);
-        if(!handle)
-        {
-            fprintf(stderr, "relocLibrary error: cannot dlopen a fake object named %s", dep->name);
-            exit(-1);
-        }
-        dep->fake_handle = handle;
-        return dlsym(handle, name);
+        Elf64_Addr resolver = sym->st_value + dep->addr;
+        //in the middle of relocating, the resolver's own library may not be done: the word gets the
+        //resolver for now, and the right answer once dep is relocated, still before openLibrary returns
+        if(currentSite && !__atomic_load_n(&dep->relocated, __ATOMIC_ACQUIRE) && deferIfunc(dep, resolver))
+            return (void *)resolver;
+        return (void *)((Elf64_Addr(*)(void))resolver)(); //what its resolver picks
     }
+    if(sym)
+        return (void *)(sym->st_value + dep->addr);
+    return NULL; //not this dependency
+}
 
-    Elf64_Sym *symtab = (Elf64_Sym *)dep->dyn_info[DT_SYMTAB]->d_un.d_ptr;
-    const char *strtab = (const char *)dep->dyn_info[DT_STRTAB]->d_un.d_ptr;
-
-    uint_fast32_t new_hash = dl_new_hash(name);
-    Elf64_Sym *sym;
-    const Elf64_Addr *bitmask = dep->l_gnu_bitmask;
-    uint32_t symidx;
-    Elf64_Addr bitmask_word = bitmask[(new_hash / __ELF_NATIVE_CLASS) & dep->l_gnu_bitmask_idxbits];
-    unsigned int hashbit1 = new_hash & (__ELF_NATIVE_CLASS - 1);
-    unsigned int hashbit2 = ((new_hash >> dep->l_gnu_shift) & (__ELF_NATIVE_CLASS - 1));
-    if ((bitmask_word >> hashbit1) & (bitmask_word >> hashbit2) & 1)
+static void *resolveLoaded(Library *lib, const char *name)
+{
+    //module IDs of our libraries mean nothing to glibc, so they get our __tls_get_addr
+    if(name[0] == '_' && strcmp(name, "__tls_get_addr") == 0)
+        return tlsGetAddr;
+    if(__atomic_load_n(&lib->scope, __ATOMIC_RELAXED))
     {
-        Elf32_Word bucket = dep->l_gnu_buckets[new_hash % dep->l_nbuckets];
-        if (bucket != 0)
-        {
-            const Elf32_Word *hasharr = &dep->l_gnu_chain_zero[bucket];
-            do
-            {
-                if (((*hasharr ^ new_hash) >> 1) == 0)
-                {
-                    symidx = hasharr - dep->l_gnu_chain_zero;
-                    /* now, symtab[symidx] is the current symbol
-                        hash table has done all work and can be stripped */
-                    const char *symname = strtab + symtab[symidx].st_name;
-                    /* FIXME: You may also want to check the visibility and strong/weak of the found symbol
-                        but... not now */
-                    /* FIXME: Please make sure no local symbols like "tmp" will be accessed here! */
-                    if (!strcmp(symname, name))
-                    {    
-                        Elf64_Sym *s = &symtab[symidx];
-                        return (void *)(s->st_value + dep->addr);
-                    }
-                }
-            } while ((*hasharr++ & 1u) == 0);
-        }
+        //the head owning the index can be closed under a lazy bind, which takes no lock, see scopeIndexRelease
+        int parity = epochEnter();
+        struct scopeIndex *idx = __atomic_load_n(&lib->scope, __ATOMIC_ACQUIRE);
+        void *res = idx ? scopeLookup(idx, name) : NULL;
+        epochLeave(parity);
+        if(idx)
+            return res;
     }
-    return NULL; //not this dependency
+    Library **search = lib->search_list;
+    while (*search)
+    {
+        void *res = symbolLookup(*search, name);
+        if(res)
+            return res;
+        search++;
+    }
+    return NULL;
 }
 
-static void relocRela(Library *lib)
+void *resolveSymbol(Library *lib, const char *name)
 {
-    //use `readelf --relocs` to see '.rela.dyn'
-    //this includes relative and glob_dat
-    Elf64_Addr start = lib->dyn_info[DT_RELA]->d_un.d_ptr;
-    Elf64_Addr size = lib->dyn_info[DT_RELASZ]->d_un.d_val;
-    Elf64_Xword nrelative = lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val;
+    //find the definition an import of `lib` binds to, NULL if nobody has it
+    void *res = resolveLoaded(lib, name);
+    if(!res && lib->lazy_deps)
+        res = lazyLoadSymbol(lib, name); //one of the dependencies LAZY_LOAD left for later may have it
+    return res;
+}
 
-    Elf64_Rela *r_start = (void *)start;
-    Elf64_Rela *r_end = r_start + nrelative; //relative_end
+static void *resolveImport(Library *lib, const Elf64_Sym *sym, const char *name)
+{
+    //a weak import is fine without a definition, not worth loading deferred dependencies for
+    //(every library has a few, like __gmon_start__)
+    if(ELF64_ST_BIND(sym->st_info) == STB_WEAK)
+        return resolveLoaded(lib, name);
+    return resolveSymbol(lib, name);
+}
+
+static void relocRelative(Library *lib, Elf64_Rela *start, Elf64_Rela *end)
+{
     //fill in all relative relocs here
-    for(Elf64_Rela *it = r_start; it < r_end; it++)
+    for(Elf64_Rela *it = start; it < end; it++)
     {
         Elf64_Addr *tmp = (void *)(lib->addr + it->r_offset);
         *tmp = lib->addr + it->r_addend;
     }
+}
 
-    Elf64_Rela *rela_end = (void *)(start + size);
+static void relocSymbolic(Library *lib, Elf64_Rela *start, Elf64_Rela *end)
+{
+    //everything after the DT_RELACOUNT relative ones, which without DT_RELACOUNT is all of .rela.dyn
     Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
     const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
-    for(Elf64_Rela *it = r_end; it < rela_end; it++)
+    for(Elf64_Rela *it = start; it < end; it++)
     {
         Elf64_Xword idx = it->r_info;
         Elf64_Sym *tmp_sym = &symtab[idx >> 32]; //from dynamic symbol table get the symbol
         Elf64_Word name = tmp_sym->st_name;
         const char *real_name = strtab + name;
+        Elf64_Addr *dest = (void *)(lib->addr + it->r_offset);
+        switch (ELF64_R_TYPE(it->r_info))
+        {
+        case R_X86_64_NONE:
+            continue;
+        case R_X86_64_RELATIVE:
+            *dest = lib->addr + it->r_addend;
+            continue;
+        case R_X86_64_IRELATIVE:
+            continue; //once everything else is done, see relocIrelative
+        case R_X86_64_DTPMOD64:
+        case R_X86_64_DTPOFF64:
+        case R_X86_64_TPOFF64:
+            relocTls(lib, it);
+            continue;
+        default:
+            break;
+        }
 
         //do glob_dat, search in searchlist
-        Library **search = lib->search_list;
-        while (*search)
+        struct relocSite site = {dest, it->r_addend}, *outer = currentSite; //LAZY_LOAD may come back here
+        currentSite = &site;
+        void *res = resolveImport(lib, tmp_sym, real_name);
+        currentSite = outer;
+        if(res)
+            *dest = (Elf64_Addr)res + it->r_addend;
+    }
+}
+
+static void relocRelr(Library *lib)
+{
+    //`-z pack-relative-relocs` packs relative relocs into DT_RELR, see the format in glibc's do-rel.h
+    //an even entry is the address of the next word to relocate,
+    //an odd one is a bitmap of which of the following 63 words need it too
+    if(!lib->dyn_info[DT_NUM + DT_RELR_NEW])
+        return;
+    const Elf64_Addr base = lib->addr;
+    const Elf64_Xword *relr = (void *)lib->dyn_info[DT_NUM + DT_RELR_NEW]->d_un.d_ptr;
+    const Elf64_Xword *relr_end = (void *)((char *)relr + lib->dyn_info[DT_NUM + DT_RELRSZ_NEW]->d_un.d_val);
+    TRACE_COUNT(lib, TRACE_RELOC_RELR, relr_end - relr);
+    Elf64_Addr *where = NULL;
+    for(; relr < relr_end; relr++)
+    {
+        Elf64_Xword entry = *relr;
+        if((entry & 1) == 0)
         {
-            void *res = symbolLookup(*search, real_name);
-            if(res)
-            {
-                void *dest = (void *)(lib->addr + it->r_offset);
-                *(Elf64_Addr *)dest = (Elf64_Addr)res + it->r_addend;
-                break;
-            }
-            search++;
+            where = (Elf64_Addr *)(base + entry);
+            *where++ += base;
+            continue;
         }
+        //only visit the set bits, the window may run past the end of the segment
+        for(Elf64_Xword bits = entry >> 1; bits; bits &= bits - 1)
+            where[__builtin_ctzll(bits)] += base;
+        where += 63;
     }
+}
 
+static void relocRela(Library *lib, int nthreads)
+{
+    //use `readelf --relocs` to see '.rela.dyn'
+    //this includes relative and glob_dat
+    if(!lib->dyn_info[DT_RELA])
+        return;
+    Elf64_Addr start = lib->dyn_info[DT_RELA]->d_un.d_ptr;
+    Elf64_Addr size = lib->dyn_info[DT_RELASZ]->d_un.d_val;
+    Elf64_Xword nrelative = (lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])?
+        lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val : 0;
+
+    Elf64_Rela *r_start = (void *)start;
+    Elf64_Rela *r_end = r_start + nrelative; //relative_end
+    Elf64_Rela *rela_end = (void *)(start + size);
+    TRACE_COUNT(lib, TRACE_RELOC_RELATIVE, r_end - r_start);
+    TRACE_COUNT(lib, TRACE_RELOC_SYMBOLIC, rela_end - r_end);
+    relocParallel(lib, r_start, r_end, relocRelative, nthreads);
+    relocParallel(lib, r_end, rela_end, relocSymbolic, nthreads);
 }
 
 static inline void lazyReloc(Library *lib, void *start, void *end)
@@ -130,7 +254,9 @@ static inline void lazyReloc(Library *lib, void *start, void *end)
             //do a simple rebasing if we're using lazy mode
             *reloc_addr += lib->addr;
             break;
-        
+        case R_X86_64_IRELATIVE:
+            break; //see relocIrelative
+
         default:
             fprintf(stderr, "relocLibrary error: unexpected PLT reloc type %lx expected in %s\n", r_info, lib->name);
             exit(-1);
@@ -139,60 +265,94 @@ static inline void lazyReloc(Library *lib, void *start, void *end)
     }
 }
 
-static void relocPLT(Library *lib, int mode)
+static void relocJumpSlots(Library *lib, Elf64_Rela *start, Elf64_Rela *end)
 {
-    //use `readelf --relocs` to see '.rela.plt'
-    Elf64_Addr start = lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
-    Elf64_Addr size = lib->dyn_info[DT_PLTRELSZ]->d_un.d_val;
-    
-    Elf64_Rela *plt_start = (void *)start;
-    Elf64_Rela *plt_end = (void *)(start + size);
-    if(mode)
-    {
-        lazyReloc(lib, plt_start, plt_end);
-        return;
-    }
     Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
     const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
-    for(Elf64_Rela *it = plt_start; it < plt_end; it++)
+    for(Elf64_Rela *it = start; it < end; it++)
     {
         Elf64_Xword idx = it->r_info;
         Elf64_Sym *tmp_sym = &symtab[idx >> 32]; //from dynamic symbol table get the symbol
         Elf64_Word name = tmp_sym->st_name;
         const char *real_name = strtab + name;
 
-        //deal with GNU IFUNC. I don't think it will be used if you mark libc.so.6 as fake
+        //GNU IFUNC of the library itself, called once all of it is relocated, see relocIrelative
         const unsigned long int r_type = it->r_info & 0xffffffff;
         if (r_type == R_X86_64_IRELATIVE)
+            continue;
+        //a profiled slot points at its stub, a deferred IFUNC would write past it
+        struct relocSite site = {(void *)(lib->addr + it->r_offset), it->r_addend}, *outer = currentSite;
+        currentSite = lib->plt_profile ? NULL : &site;
+        void *res = resolveImport(lib, tmp_sym, real_name);
+        currentSite = outer;
+        if(res)
         {
-            Elf64_Addr value = lib->addr + it->r_addend;
-            //because it's IFUNC, the true address of the symbol is the address IFUNC resolver pointing to
-            value = ((Elf64_Addr(*)(void))value)();
             void *dest = (void *)(lib->addr + it->r_offset);
+            Elf64_Addr value = (Elf64_Addr)res + it->r_addend;
+            if(lib->plt_profile)
+                value = pltProfileBind(lib, it - (Elf64_Rela *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr, value);
             *(Elf64_Addr *)dest = value;
-            continue;
-        }
-        Library **search = lib->search_list;
-        while (*search)
-        {
-            void *res = symbolLookup(*search, real_name);
-            if(res)
-            {
-                void *dest = (void *)(lib->addr + it->r_offset);
-                *(Elf64_Addr *)dest = (Elf64_Addr)res + it->r_addend;
-                break;
-            }
-            search++;
         }
     }
 }
 
-static void relocInit(Library *lib, int mode)
+static void relocPLT(Library *lib, int mode)
+{
+    //use `readelf --relocs` to see '.rela.plt'
+    if(!lib->dyn_info[DT_JMPREL])
+        return; //no function imports at all
+    Elf64_Addr start = lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+    Elf64_Addr size = lib->dyn_info[DT_PLTRELSZ]->d_un.d_val;
+    
+    Elf64_Rela *plt_start = (void *)start;
+    Elf64_Rela *plt_end = (void *)(start + size);
+    TRACE_COUNT(lib, TRACE_RELOC_JUMP_SLOT, plt_end - plt_start);
+    if(mode & LAZY_BIND)
+    {
+        lazyReloc(lib, plt_start, plt_end);
+        return;
+    }
+    //the PLT profile finds a slot by its index in .rela.plt, which relocParallel may hand out reordered
+    relocParallel(lib, plt_start, plt_end, relocJumpSlots, lib->plt_profile ? 1 : RELOC_THREAD_NUM(mode));
+}
+
+static void irelativeRange(Library *lib, Elf64_Rela *start, Elf64_Rela *end)
+{
+    for(Elf64_Rela *it = start; it < end; it++)
+    {
+        if(ELF64_R_TYPE(it->r_info) != R_X86_64_IRELATIVE)
+            continue;
+        //because it's IFUNC, the true address of the symbol is the address IFUNC resolver pointing to
+        Elf64_Addr *dest = (void *)(lib->addr + it->r_offset);
+        *dest = ((Elf64_Addr(*)(void))(lib->addr + it->r_addend))();
+    }
+}
+
+static void relocIrelative(Library *lib)
+{
+    //IFUNC resolvers run code of lib that may read its GOT, so like ld.so they come last, one at a time,
+    //after the parallel passes are through with every other entry of .rela.dyn and .rela.plt
+    if(lib->dyn_info[DT_RELA])
+    {
+        Elf64_Rela *start = (void *)lib->dyn_info[DT_RELA]->d_un.d_ptr;
+        Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[DT_RELASZ]->d_un.d_val);
+        if(lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])
+            start += lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val;
+        irelativeRange(lib, start, end);
+    }
+    if(lib->dyn_info[DT_JMPREL])
+    {
+        Elf64_Rela *start = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+        irelativeRange(lib, start, (void *)((Elf64_Addr)start + lib->dyn_info[DT_PLTRELSZ]->d_un.d_val));
+    }
+}
+
+void relocInit(Library *lib, int mode)
 {
     //fill in critical GOT info needed by lazy binding
     extern void trampoline(Elf64_Word);
 
-    if(mode)
+    if(mode & LAZY_BIND)
     {
         Elf64_Addr *got = (Elf64_Addr *)lib->dyn_info[DT_PLTGOT]->d_un.d_ptr;
         got[1] = (Elf64_Addr)lib;
@@ -200,11 +360,47 @@ static void relocInit(Library *lib, int mode)
     }
 }
 
+void relocInstance(Library *lib, int mode)
+{
+    //the part of relocLibrary that only depends on where lib is, imports are replayed by instances.c
+    relocInit(lib, mode);
+    relocRelr(lib);
+    if(lib->dyn_info[DT_RELA])
+    {
+        Elf64_Rela *r_start = (void *)lib->dyn_info[DT_RELA]->d_un.d_ptr;
+        Elf64_Rela *r_end = r_start + ((lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])?
+            lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val : 0);
+        Elf64_Rela *rela_end = (void *)((Elf64_Addr)r_start + lib->dyn_info[DT_RELASZ]->d_un.d_val);
+        relocParallel(lib, r_start, r_end, relocRelative, RELOC_THREAD_NUM(mode));
+        //TLS relocations name the instance's own module, so they aren't in the plan
+        for(Elf64_Rela *it = r_end; it < rela_end; it++)
+            if(isTlsReloc(ELF64_R_TYPE(it->r_info)))
+                relocTls(lib, it);
+    }
+    if((mode & LAZY_BIND) && lib->dyn_info[DT_JMPREL])
+    {
+        Elf64_Addr start = lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+        lazyReloc(lib, (void *)start, (void *)(start + lib->dyn_info[DT_PLTRELSZ]->d_un.d_val));
+    }
+    lib->relocated = 1;
+}
+
 void relocLibrary(Library *lib, int mode)
 {
     if(lib->fake)
         return; //no point in relocating a fake object
     relocInit(lib, mode);
-    relocRela(lib);
+    TRACE_BEGIN(relr_start);
+    relocRelr(lib);
+    TRACE_END(lib, TRACE_RELR, relr_start);
+    TRACE_BEGIN(rela_start);
+    relocRela(lib, RELOC_THREAD_NUM(mode));
+    TRACE_END(lib, TRACE_RELA, rela_start);
+    TRACE_BEGIN(plt_start);
+    if(mode & PLT_PROFILE)
+        pltProfileSetup(lib, mode);
     relocPLT(lib, mode);
+    TRACE_END(lib, TRACE_PLT, plt_start);
+    relocIrelative(lib);
+    finishRelocation(lib);
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+//split a relocation table into page-aligned chunks and apply them on a handful of threads
+//every relocation writes its own word, so any split gives the same result as the serial loop.
+//chunks are cut between pages, so no two threads dirty the same page. That needs the table in page order,
+//which holds for the relative part but not for the symbolic one (linkers sort it by symbol), so a table
+//that isn't is bucketed by page into a copy first
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
+
+#define PARALLEL_MIN_RELOCS 4096 //below this, thread creation costs more than it saves
+#define CHUNK_MIN_RELOCS 1024
+
+struct relocJob
+{
+    Library *lib;
+    Elf64_Rela *start;
+    relocRange fn;
+    size_t *bounds; //chunk i is [bounds[i], bounds[i + 1])
+    size_t nchunks;
+    size_t next; //next chunk to grab, taken with an atomic add
+};
+
+static void *relocWorker(void *arg)
+{
+    struct relocJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks)
+        job->fn(job->lib, job->start + job->bounds[i], job->start + job->bounds[i + 1]);
+    return NULL;
+}
+
+static Elf64_Rela *byPage(Library *lib, Elf64_Rela *start, size_t count, uint64_t pagesize)
+{
+    //NULL if the table is in page order already, else a copy that is, by a counting sort over the pages
+    //of lib. Entries of a page keep their order, which matters for nothing but is what the serial loop does
+    size_t i = 1;
+    while (i < count && ALIGN_DOWN(start[i].r_offset, pagesize) >= ALIGN_DOWN(start[i - 1].r_offset, pagesize))
+        i++;
+    if (i == count)
+        return NULL;
+    size_t npages = lib->maplength / pagesize + 1;
+    size_t *first = calloc(npages + 1, sizeof(size_t));
+    for (i = 0; i < count; i++)
+    {
+        size_t page = start[i].r_offset / pagesize;
+        first[(page < npages ? page : npages - 1) + 1]++; //a broken offset, relocating it crashes either way
+    }
+    for (size_t p = 0; p < npages; p++)
+        first[p + 1] += first[p];
+    Elf64_Rela *sorted = malloc(count * sizeof(Elf64_Rela));
+    for (i = 0; i < count; i++)
+    {
+        size_t page = start[i].r_offset / pagesize;
+        sorted[first[page < npages ? page : npages - 1]++] = start[i];
+    }
+    free(first);
+    return sorted;
+}
+
+void relocParallel(Library *lib, Elf64_Rela *start, Elf64_Rela *end, relocRange fn, int nthreads)
+{
+    size_t count = end - start;
+    if (nthreads <= 1 || count < PARALLEL_MIN_RELOCS)
+    {
+        fn(lib, start, end);
+        return;
+    }
+
+    //a few chunks per thread so a slow chunk (say, one full of fake lookups) doesn't stall the rest
+    size_t target = count / (nthreads * 4);
+    if (target < CHUNK_MIN_RELOCS)
+        target = CHUNK_MIN_RELOCS;
+    uint64_t pagesize = getpagesize();
+    Elf64_Rela *sorted = byPage(lib, start, count, pagesize);
+    if (sorted)
+        start = sorted;
+    size_t *bounds = malloc((count / target + 2) * sizeof(size_t));
+    size_t nchunks = 0;
+    bounds[0] = 0;
+    for (size_t b = target; b < count; b += target)
+    {
+        //move the cut until it falls on a page change, the table is in page order by now
+        while (b < count && ALIGN_DOWN(start[b].r_offset, pagesize) == ALIGN_DOWN(start[b - 1].r_offset, pagesize))
+            b++;
+        if (b >= count)
+            break;
+        bounds[++nchunks] = b;
+    }
+    bounds[++nchunks] = count;
+
+    struct relocJob job = {lib, start, fn, bounds, nchunks, 0};
+    pthread_t workers[nthreads - 1];
+    int nworkers = 0;
+    for (; nworkers < nthreads - 1; nworkers++)
+    {
+        if (pthread_create(&workers[nworkers], NULL, relocWorker, &job) != 0)
+            break; //fine, whoever is running will pick up the remaining chunks
+    }
+    relocWorker(&job); //the caller works too
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(bounds);
+    free(sorted);
+}
@@ -0,0 +1,206 @@
+//relocate a library and every dependency that isn't yet, a few libraries at a time.
+//resolving an import only reads symbol tables, so the order libraries are relocated in doesn't matter,
+//except for those running code of their own at relocation time: IFUNC resolvers (IRELATIVE) can call
+//into their dependencies, and a COPY reads a dependency's data. Such a library waits for its whole scope.
+//locking: relocChain takes the reloc_lock of every library it is going to relocate before starting, by address,
+//and holds them until the chain is done, so two threads opening different members of a DT_NEEDED cycle just
+//wait for each other in turn. nobody waits on a reloc_lock while holding one out of that order or the registry.
+//the one exception is LAZY_LOAD, which may open a library from inside relocLibrary, locks held: that relocation
+//only try-locks, and what it can't have is left to whoever holds it, maybe a relocation up our own stack
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SCHEDULER_MAX_THREADS 8
+
+extern int scopeOrder(Library *head, Library ***order);
+extern void relocLibrary(Library *lib, int mode);
+
+struct relocSchedule
+{
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    int mode;
+    int n;
+    Library **libs;
+    char *needs; //needs[i * n + j]: libs[i] waits until libs[j] is relocated
+    int *state; //0 waiting, 1 being relocated, 2 done
+    int running, finished;
+};
+
+static __thread struct relocSchedule *currentSchedule; //the one this thread is relocating a library of, see LAZY_LOAD
+
+static int runsCode(Elf64_Rela *start, Elf64_Rela *end)
+{
+    for(Elf64_Rela *it = start; it < end; it++)
+        if(ELF64_R_TYPE(it->r_info) == R_X86_64_IRELATIVE || ELF64_R_TYPE(it->r_info) == R_X86_64_COPY)
+            return 1;
+    return 0;
+}
+
+static int needsOrder(Library *lib)
+{
+    //IRELATIVE and COPY sit among the symbolic relocations or in .rela.plt, never in the relative part
+    if(lib->dyn_info[DT_RELA])
+    {
+        Elf64_Rela *start = (void *)lib->dyn_info[DT_RELA]->d_un.d_ptr;
+        Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[DT_RELASZ]->d_un.d_val);
+        if(lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW])
+            start += lib->dyn_info[DT_NUM + DT_RELACOUNT_NEW]->d_un.d_val;
+        if(runsCode(start, end))
+            return 1;
+    }
+    if(lib->dyn_info[DT_JMPREL])
+    {
+        Elf64_Rela *start = (void *)lib->dyn_info[DT_JMPREL]->d_un.d_ptr;
+        Elf64_Rela *end = (void *)((Elf64_Addr)start + lib->dyn_info[DT_PLTRELSZ]->d_un.d_val);
+        return runsCode(start, end);
+    }
+    return 0;
+}
+
+static int nextReady(struct relocSchedule *s)
+{
+    //call with s->lock held: a waiting library whose dependencies are all done, or -1
+    for(int i = 0; i < s->n; i++)
+    {
+        if(s->state[i] != 0)
+            continue;
+        int ready = 1;
+        for(int j = 0; j < s->n && ready; j++)
+            ready = !s->needs[i * s->n + j] || s->state[j] == 2;
+        if(ready)
+            return i;
+    }
+    return -1;
+}
+
+static void *schedulerWorker(void *arg)
+{
+    struct relocSchedule *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while(s->finished < s->n)
+    {
+        int i = nextReady(s);
+        if(i < 0 && s->running == 0)
+        {
+            //only libraries waiting on each other are left, a cycle of IFUNC users: ld.so doesn't get
+            //that right either, just go in scope order
+            for(i = 0; s->state[i] != 0; i++)
+                ;
+        }
+        if(i < 0)
+        {
+            pthread_cond_wait(&s->progress, &s->lock);
+            continue;
+        }
+        s->state[i] = 1;
+        s->running++;
+        pthread_mutex_unlock(&s->lock);
+
+        Library *lib = s->libs[i];
+        struct relocSchedule *outer = currentSchedule; //relocLibrary may get here again through LAZY_LOAD
+        currentSchedule = s;
+        relocLibrary(lib, s->mode); //relocChain holds its reloc_lock
+        currentSchedule = outer;
+
+        pthread_mutex_lock(&s->lock);
+        s->state[i] = 2;
+        s->running--;
+        s->finished++;
+        pthread_cond_broadcast(&s->progress);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+void relocChain(Library *head, int mode)
+{
+    //relocate head and every real library in its scope that isn't yet, waiting for whoever is at it already
+    Library **order;
+    int total = scopeOrder(head, &order), n = 0;
+    for(int i = 0; i < total; i++)
+        if(!order[i]->fake && !order[i]->relocated)
+            order[n++] = order[i];
+
+    //lock them by address, see the top of the file, then keep only the ones still not relocated
+    int *byAddr = malloc((n + 1) * sizeof(int));
+    char *mine = calloc(n + 1, 1);
+    for(int i = 0; i < n; i++)
+    {
+        int j = i;
+        for(; j > 0 && order[byAddr[j - 1]] > order[i]; j--)
+            byAddr[j] = byAddr[j - 1];
+        byAddr[j] = i;
+    }
+    for(int k = 0; k < n; k++)
+    {
+        Library *lib = order[byAddr[k]];
+        if(currentSchedule)
+        {
+            if(pthread_mutex_trylock(&lib->reloc_lock) != 0)
+                continue; //binding to it unrelocated is fine, its IFUNCs wait for it, see symbolLookup
+        }
+        else
+            pthread_mutex_lock(&lib->reloc_lock);
+        if(lib->relocated)
+            pthread_mutex_unlock(&lib->reloc_lock); //done while we waited
+        else
+            mine[byAddr[k]] = 1;
+    }
+    int held = 0;
+    for(int i = 0; i < n; i++)
+        if(mine[i])
+            order[held++] = order[i];
+    n = held;
+    free(byAddr);
+    free(mine);
+
+    struct relocSchedule s = {0};
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.progress, NULL);
+    s.mode = mode;
+    s.n = n;
+    s.libs = order;
+    s.needs = calloc(n * n + 1, 1);
+    s.state = calloc(n + 1, sizeof(int));
+    for(int i = 0; i < n; i++)
+    {
+        if(!needsOrder(order[i]))
+            continue;
+        Library **scope;
+        int nscope = scopeOrder(order[i], &scope);
+        for(int j = 0; j < n; j++)
+            for(int k = 1; k < nscope; k++) //scope[0] is itself
+                if(scope[k] == order[j])
+                    s.needs[i * n + j] = 1;
+        free(scope);
+    }
+
+    //one library per thread, the threads of RELOC_THREADS are for the tables of a single library
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < n ? cpus : n;
+    if(nthreads > SCHEDULER_MAX_THREADS)
+        nthreads = SCHEDULER_MAX_THREADS;
+    pthread_t workers[SCHEDULER_MAX_THREADS];
+    int nworkers = 0;
+    for(; nworkers < nthreads - 1; nworkers++)
+        if(pthread_create(&workers[nworkers], NULL, schedulerWorker, &s) != 0)
+            break; //the rest is done by whoever is running
+    schedulerWorker(&s); //the caller works too
+    for(int i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+
+    for(int i = 0; i < n; i++)
+        pthread_mutex_unlock(&order[i]->reloc_lock);
+
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.progress);
+    free(s.needs);
+    free(s.state);
+    free(order);
+}
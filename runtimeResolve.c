@@ -1,10 +1,12 @@
 //do the lazy bind of PLT
 #include "library.h"
+#include "trace.h"
 #include <elf.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-extern void *symbolLookup(Library *dep, const char *name);
+extern void *resolveSymbol(Library *lib, const char *name);
+extern Elf64_Addr pltProfileBind(Library *lib, uint64_t index, Elf64_Addr target);
 
 Elf64_Addr __attribute__((visibility ("hidden"))) //this makes trampoline to call it w/o plt
 runtimeResolve(Library *lib, Elf64_Word reloc_entry)
@@ -19,24 +21,19 @@ runtimeResolve(Library *lib, Elf64_Word reloc_entry)
     Elf64_Word name = tmp_sym->st_name;
     const char *real_name = strtab + name; //finally, the name of the reloc entry
 
-    Library **search = lib->search_list;
-    void *res = NULL;
-    while (*search)
-    {
-        res = symbolLookup(*search, real_name);
-        if(res)
-        {
-            void *dest = (void *)(lib->addr + reloc_obj->r_offset);
-            *(Elf64_Addr *)dest = (Elf64_Addr)res + reloc_obj->r_addend;
-            fprintf(stderr, "runtimeResolve debug: lazy bind a symbol named %s\n", real_name);
-            break;
-        }
-        search++;
-    }
+    void *res = resolveSymbol(lib, real_name);
     if(!res)
     {
         fprintf(stderr, "runtimeResolve error: cannot resolve a PLT entry called %s in Library %s\n", real_name, lib->name);
         exit(-1);
     }
-    return (Elf64_Addr)res + reloc_obj->r_addend;
+    TRACE_COUNT(lib, TRACE_LAZY_BINDS, 1);
+    void *dest = (void *)(lib->addr + reloc_obj->r_offset);
+    Elf64_Addr value = (Elf64_Addr)res + reloc_obj->r_addend;
+    if(lib->plt_profile)
+        value = pltProfileBind(lib, reloc_entry, value); //the stub counts this first call too
+    //threads racing on the same slot resolve the same value, so no lock: whichever store lands is right,
+    //and a caller reading the GOT sees either the old PLT address or the whole new one
+    __atomic_store_n((Elf64_Addr *)dest, value, __ATOMIC_RELEASE);
+    return value;
 }
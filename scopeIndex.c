@@ -0,0 +1,178 @@
+//merge the exported symbols of a whole scope into one hash table, so an import costs one probe
+//ld.so walks the scope library by library, which is what symbolLookup does without this.
+//the index belongs to the head of the chain it was built for, and only the libraries mapped along with it
+//resolve through it. A dependency shared with a chain opened later keeps the one it had
+#include "library.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+extern void *symbolLookup(Library *dep, const char *name);
+extern int symbolExported(const Elf64_Sym *sym);
+extern uint32_t symbolCount(Library *lib);
+extern void epochRetire(void *ptr);
+
+//what addr of an entry means, symbolLookup decides for everything that isn't a plain address
+#define ENTRY_READY 0 //addr is the answer, NULL included
+#define ENTRY_ONCE 1 //ask symbolLookup on first use: dlsym for fake objects, the resolver for IFUNC
+#define ENTRY_TLS 2 //ask symbolLookup every time, each thread has a copy of its own
+
+struct scopeEntry
+{
+    const char *name; //NULL means an empty slot
+    uint32_t hash;
+    uint32_t state;
+    Library *owner; //first library in search order defining it
+    void *addr;
+};
+
+struct scopeIndex
+{
+    struct scopeEntry *table;
+    uint64_t mask; //capacity - 1, capacity is a power of 2
+    uint64_t used;
+    Library *head; //the owner
+};
+
+static struct scopeEntry *probe(struct scopeIndex *idx, const char *name, uint32_t hash)
+{
+    //linear probing, stop at the match or the first empty slot
+    uint64_t i = hash & idx->mask;
+    while (1)
+    {
+        struct scopeEntry *e = &idx->table[i];
+        if (!e->name)
+            return e;
+        if (e->hash == hash && strcmp(e->name, name) == 0)
+            return e;
+        i = (i + 1) & idx->mask;
+    }
+}
+
+static void grow(struct scopeIndex *idx, uint64_t want)
+{
+    //keep the load factor under 1/2 so probe sequences stay short
+    uint64_t cap = idx->mask + 1;
+    if (idx->table && want * 2 <= cap)
+        return;
+    while (want * 2 > cap)
+        cap <<= 1;
+    struct scopeEntry *old = idx->table;
+    uint64_t oldcap = old ? idx->mask + 1 : 0;
+    idx->table = calloc(cap, sizeof(struct scopeEntry));
+    if (!idx->table)
+    {
+        fprintf(stderr, "scopeIndex error: cannot allocate %lu slots\n", cap);
+        exit(-1);
+    }
+    idx->mask = cap - 1;
+    for (uint64_t i = 0; i < oldcap; i++)
+        if (old[i].name)
+            *probe(idx, old[i].name, old[i].hash) = old[i];
+    free(old);
+}
+
+static void merge(struct scopeIndex *idx, Library *lib)
+{
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+    uint32_t nsyms = symbolCount(lib);
+
+    grow(idx, idx->used + nsyms);
+    for (uint32_t i = 0; i < nsyms; i++)
+    {
+        if (!symbolExported(&symtab[i]))
+            continue;
+        const char *name = strtab + symtab[i].st_name;
+        uint32_t hash = dl_new_hash(name);
+        struct scopeEntry *e = probe(idx, name, hash);
+        if (e->name)
+            continue; //someone earlier in search order already defines it
+        e->name = name;
+        e->hash = hash;
+        e->owner = lib;
+        //not calling IFUNC resolvers here, lib isn't relocated yet
+        if (ELF64_ST_TYPE(symtab[i].st_info) == STT_TLS)
+            e->state = ENTRY_TLS;
+        else if (lib->fake || ELF64_ST_TYPE(symtab[i].st_info) == STT_GNU_IFUNC)
+            e->state = ENTRY_ONCE;
+        else
+            e->addr = (void *)(symtab[i].st_value + lib->addr);
+        idx->used++;
+    }
+}
+
+int scopeOrder(Library *head, Library ***order)
+{
+    //breadth first over search_list like ld.so's l_searchlist, so deps shared with other chains count too
+    int n = 0, cap = 16;
+    Library **list = malloc(cap * sizeof(Library *));
+    list[n++] = head;
+    for (int i = 0; i < n; i++)
+    {
+        if (!list[i]->search_list)
+            continue; //not mapped yet
+        for (Library **dep = list[i]->search_list + 1; *dep; dep++)
+        {
+            int seen = 0;
+            for (int j = 0; j < n && !seen; j++)
+                seen = list[j] == *dep;
+            if (seen)
+                continue;
+            if (n == cap)
+                list = realloc(list, (cap *= 2) * sizeof(Library *));
+            list[n++] = *dep;
+        }
+    }
+    *order = list;
+    return n;
+}
+
+void scopeIndexBuild(Library *head)
+{
+    //build the index for the scope of `head`, call with the registry held right after mapping its chain
+    struct scopeIndex *idx = calloc(1, sizeof(struct scopeIndex));
+    idx->head = head;
+    Library **order;
+    int n = scopeOrder(head, &order);
+    for (int i = 0; i < n; i++)
+        merge(idx, order[i]);
+    free(order);
+    for (Library *lib = head; lib; lib = lib->next)
+        __atomic_store_n(&lib->scope, idx, __ATOMIC_RELEASE);
+}
+
+void scopeIndexRelease(Library *lib)
+{
+    //lib goes away: if it owns the index, whoever still points at it falls back to search_list.
+    //lookups take no lock, so the index is only freed once none can be in it, see addressIndex.c
+    struct scopeIndex *idx = lib->scope;
+    __atomic_store_n(&lib->scope, NULL, __ATOMIC_RELEASE);
+    if (!idx || idx->head != lib)
+        return;
+    for (Library *member = lib->next; member; member = member->next)
+        if (member->scope == idx)
+            __atomic_store_n(&member->scope, NULL, __ATOMIC_RELEASE);
+    epochRetire(idx->table);
+    epochRetire(idx);
+}
+
+void *scopeLookup(struct scopeIndex *idx, const char *name)
+{
+    struct scopeEntry *e = probe(idx, name, dl_new_hash(name));
+    if (!e->name)
+        return NULL;
+    uint32_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+    if (state == ENTRY_READY)
+        return e->addr;
+    //an IFUNC of a library not relocated yet gives a stand-in, see symbolLookup
+    int final = e->owner->fake || __atomic_load_n(&e->owner->relocated, __ATOMIC_ACQUIRE);
+    void *addr = symbolLookup(e->owner, name);
+    if (state == ENTRY_ONCE && final)
+    {
+        //a miss too, dlsym won't change its mind. Racing threads get the same answer, both stores are fine
+        e->addr = addr;
+        __atomic_store_n(&e->state, ENTRY_READY, __ATOMIC_RELEASE);
+    }
+    return addr;
+}
@@ -0,0 +1,333 @@
+//thread-local storage of the libraries we map ourselves, glibc only knows about the ones it dlopened.
+//every library with a PT_TLS gets a module ID above any glibc hands out, so our __tls_get_addr
+//can pass theirs on. A thread gets its copy of a block the first time it asks for it.
+//initial-exec code (DF_STATIC_TLS) needs its block at a fixed offset from the thread pointer, which
+//we can only give from tlsReserve, a static TLS block of libredl itself
+#define _GNU_SOURCE //for dlinfo
+#include "library.h"
+#include "dl-rebuild.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#define ALIGN_DOWN(base, size) ((base) & -((__typeof__(base))(size)))
+#define ALIGN_UP(base, size) ALIGN_DOWN((base) + (size)-1, (size))
+
+#define TLS_MODULES 1024
+#define TLS_MODID_BASE (1ul << 32) //module ID of tlsModules[i] is TLS_MODID_BASE + i
+//small enough for glibc to find room for libredl even when it is dlopened itself.
+//the first half may be handed out to anyone who fits, the rest is kept for DF_STATIC_TLS
+#define TLS_STATIC_RESERVE 1024
+#define TLS_STATIC_ALIGN 64
+
+//what general and local dynamic code passes to __tls_get_addr
+typedef struct
+{
+    uint64_t ti_module;
+    uint64_t ti_offset;
+} tlsIndex;
+
+struct tlsModule
+{
+    Library *lib; //NULL when the slot is free
+    uint64_t gen; //bumped when lib goes away, so threads know the block they have is stale
+    const void *image; //.tdata, copied into every new block
+    uint64_t filesz, memsz, align;
+    int64_t static_offset; //into tlsReserve, or -1 when every thread allocates it
+};
+
+//one per module a thread has touched, indexed like tlsModules
+struct dtvEntry
+{
+    void *block;
+    uint64_t gen;
+    int is_static;
+};
+
+struct tlsVector
+{
+    uint64_t len;
+    struct dtvEntry e[];
+};
+
+static struct tlsModule tlsModules[TLS_MODULES];
+static pthread_mutex_t tlsLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t tlsReserveUsed; //static TLS is never given back, other threads may still have data in it
+static pthread_key_t tlsKey; //only there to free a thread's blocks when it exits
+static pthread_once_t tlsKeyOnce = PTHREAD_ONCE_INIT;
+
+static __thread char tlsReserve[TLS_STATIC_RESERVE]
+    __attribute__((tls_model("initial-exec"), aligned(TLS_STATIC_ALIGN)));
+static __thread struct tlsVector *tlsVec __attribute__((tls_model("initial-exec")));
+
+extern void *__tls_get_addr(tlsIndex *ti); //glibc's, for the modules of fake objects
+extern Elf64_Sym *hashLookup(Library *lib, const char *name);
+extern void *fakeLookup(Library *lib, const char *name);
+extern void *lazyLoadSymbol(Library *lib, const char *name);
+
+static inline uint64_t threadPointer(void)
+{
+    uint64_t tp;
+    __asm__ ("mov %%fs:0, %0" : "=r"(tp));
+    return tp;
+}
+
+static int isZero(const char *p, uint64_t len)
+{
+    for(uint64_t i = 0; i < len; i++)
+        if(p[i])
+            return 0;
+    return 1;
+}
+
+void tlsRegister(Library *lib)
+{
+    //give lib a module ID if it has a PT_TLS, call after fill_info
+    if(lib->fake)
+        return; //glibc has set one up already
+    Elf64_Phdr *tls = NULL;
+    for(Elf64_Phdr *ph = lib->phdr; ph < &lib->phdr[lib->phnum]; ph++)
+        if(ph->p_type == PT_TLS)
+            tls = ph;
+    if(!tls || tls->p_memsz == 0)
+        return;
+    int need_static = lib->dyn_info[DT_FLAGS] && (lib->dyn_info[DT_FLAGS]->d_un.d_val & DF_STATIC_TLS);
+    //tlsReserve of a thread created before us holds zeros, and we can't reach it to copy .tdata in
+    int zero_image = isZero((const char *)(lib->addr + tls->p_vaddr), tls->p_filesz);
+    if(need_static && !zero_image)
+    {
+        fprintf(stderr, "tls error: %s has initialized initial-exec TLS, only dlopen can set that up\n", lib->name);
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&tlsLock);
+    int i = 0;
+    while(i < TLS_MODULES && tlsModules[i].lib)
+        i++;
+    if(i == TLS_MODULES)
+    {
+        fprintf(stderr, "tls error: more than %d libraries with TLS when loading %s\n", TLS_MODULES, lib->name);
+        exit(-1);
+    }
+    struct tlsModule *m = &tlsModules[i];
+    m->image = (const void *)(lib->addr + tls->p_vaddr);
+    m->filesz = tls->p_filesz;
+    m->memsz = tls->p_memsz;
+    m->align = tls->p_align ? tls->p_align : 1;
+    m->static_offset = -1;
+    uint64_t offset = ALIGN_UP(tlsReserveUsed, m->align);
+    uint64_t limit = need_static ? TLS_STATIC_RESERVE : TLS_STATIC_RESERVE / 2;
+    if(zero_image && m->align <= TLS_STATIC_ALIGN && offset + m->memsz <= limit)
+    {
+        m->static_offset = offset;
+        tlsReserveUsed = offset + m->memsz;
+        //the same in every thread, tlsReserve is part of the static TLS of libredl
+        lib->tls_offset = (int64_t)((uint64_t)tlsReserve + offset - threadPointer());
+    }
+    else if(need_static)
+    {
+        fprintf(stderr, "tls error: no static TLS left for %s\n", lib->name);
+        exit(-1);
+    }
+    __atomic_store_n(&m->lib, lib, __ATOMIC_RELEASE);
+    lib->tls_modid = TLS_MODID_BASE + i;
+    pthread_mutex_unlock(&tlsLock);
+}
+
+static void tlsThreadExit(void *arg)
+{
+    struct tlsVector *v = arg;
+    for(uint64_t i = 0; i < v->len; i++)
+        if(!v->e[i].is_static)
+            free(v->e[i].block);
+    free(v);
+    tlsVec = NULL; //in case a later destructor touches TLS again
+}
+
+static void tlsKeyCreate(void)
+{
+    pthread_key_create(&tlsKey, tlsThreadExit);
+}
+
+static __attribute__((noinline)) void *tlsBlock(uint64_t i)
+{
+    //first access of this thread to module i, or the library it had a block of is gone
+    pthread_mutex_lock(&tlsLock);
+    struct tlsVector *v = tlsVec;
+    if(!v || i >= v->len)
+    {
+        uint64_t len = v ? v->len : 0, newlen = len ? len * 2 : 16;
+        while(newlen <= i)
+            newlen *= 2;
+        v = realloc(v, sizeof(struct tlsVector) + newlen * sizeof(struct dtvEntry));
+        memset(&v->e[len], 0, (newlen - len) * sizeof(struct dtvEntry));
+        v->len = newlen;
+        tlsVec = v;
+        pthread_once(&tlsKeyOnce, tlsKeyCreate);
+        pthread_setspecific(tlsKey, v);
+    }
+    struct dtvEntry *e = &v->e[i];
+    struct tlsModule *m = &tlsModules[i];
+    if(!e->is_static)
+        free(e->block);
+    if(!m->lib)
+    {
+        fprintf(stderr, "tls error: thread-local variable of a library that was closed\n");
+        exit(-1);
+    }
+    if(m->static_offset >= 0)
+    {
+        e->block = tlsReserve + m->static_offset;
+        e->is_static = 1;
+    }
+    else
+    {
+        if(posix_memalign(&e->block, m->align < sizeof(void *) ? sizeof(void *) : m->align, m->memsz))
+        {
+            fprintf(stderr, "tls error: out of memory for a TLS block of %s\n", m->lib->name);
+            exit(-1);
+        }
+        memcpy(e->block, m->image, m->filesz);
+        memset((char *)e->block + m->filesz, 0, m->memsz - m->filesz);
+        e->is_static = 0;
+    }
+    e->gen = m->gen;
+    void *block = e->block;
+    pthread_mutex_unlock(&tlsLock);
+    return block;
+}
+
+//what our libraries get when they import __tls_get_addr, see resolveSymbol.
+//old compilers called it with a misaligned stack, glibc's realigns too
+__attribute__((force_align_arg_pointer)) void *tlsGetAddr(tlsIndex *ti)
+{
+    uint64_t i = ti->ti_module - TLS_MODID_BASE;
+    if(i >= TLS_MODULES)
+        return __tls_get_addr(ti); //a module of glibc's
+    struct tlsVector *v = tlsVec;
+    if(__builtin_expect(v && i < v->len && v->e[i].block
+        && v->e[i].gen == __atomic_load_n(&tlsModules[i].gen, __ATOMIC_RELAXED), 1))
+        return (char *)v->e[i].block + ti->ti_offset;
+    return (char *)tlsBlock(i) + ti->ti_offset;
+}
+
+void *tlsSymbolAddress(Library *lib, const Elf64_Sym *sym)
+{
+    //where an STT_TLS symbol of lib lives in the calling thread, like dlsym gives
+    tlsIndex ti = {lib->tls_modid, sym->st_value};
+    return tlsGetAddr(&ti);
+}
+
+//where a thread-local symbol is defined, in the terms of the three TLS relocations
+struct tlsTarget
+{
+    uint64_t modid, offset;
+    int64_t tpoff; //of the block from the thread pointer
+    int is_static;
+};
+
+static int fakeTarget(Library *dep, const char *name, struct tlsTarget *t)
+{
+    //dlsym answers with the copy of the calling thread, which the memo can't keep
+    if(!fakeLookup(dep, name))
+        return 0;
+    char *addr = dlsym(dep->fake_handle, name);
+    size_t modid;
+    void *block;
+    if(!addr || dlinfo(dep->fake_handle, RTLD_DI_TLS_MODID, &modid) != 0 || modid == 0
+        || dlinfo(dep->fake_handle, RTLD_DI_TLS_DATA, &block) != 0 || !block)
+        return 0;
+    t->modid = modid;
+    t->offset = addr - (char *)block;
+    //libc and ld.so are in static TLS, a fake object opened later may not be
+    t->tpoff = (int64_t)((uint64_t)block - threadPointer());
+    t->is_static = 1;
+    return 1;
+}
+
+static int searchTarget(Library *lib, const char *name, struct tlsTarget *t)
+{
+    //the first of lib's search_list that defines TLS symbol `name`
+    for(Library **search = lib->search_list; *search; search++)
+    {
+        Library *dep = *search;
+        if(dep->fake)
+        {
+            if(fakeTarget(dep, name, t))
+                return 1;
+            continue;
+        }
+        Elf64_Sym *def = hashLookup(dep, name);
+        if(def && ELF64_ST_TYPE(def->st_info) == STT_TLS)
+        {
+            *t = (struct tlsTarget){dep->tls_modid, def->st_value, dep->tls_offset, dep->tls_offset != 0};
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void relocTls(Library *lib, Elf64_Rela *r)
+{
+    //DTPMOD64, DTPOFF64 or TPOFF64, see isTlsReloc
+    Elf64_Sym *symtab = (Elf64_Sym *)lib->dyn_info[DT_SYMTAB]->d_un.d_ptr;
+    const char *strtab = (const char *)lib->dyn_info[DT_STRTAB]->d_un.d_ptr;
+    Elf64_Sym *sym = &symtab[ELF64_R_SYM(r->r_info)];
+    struct tlsTarget t = {0};
+    int found = 0;
+    //symbol 0 is local dynamic code asking for its own module
+    if(ELF64_R_SYM(r->r_info) == 0 || ELF64_ST_BIND(sym->st_info) == STB_LOCAL)
+    {
+        t = (struct tlsTarget){lib->tls_modid, sym->st_value, lib->tls_offset, lib->tls_offset != 0};
+        found = 1;
+    }
+    if(!found)
+        found = searchTarget(lib, strtab + sym->st_name, &t);
+    //a deferred dependency that has it is in search_list once loaded, see LAZY_LOAD
+    if(!found && lib->lazy_deps && lazyLoadSymbol(lib, strtab + sym->st_name))
+        found = searchTarget(lib, strtab + sym->st_name, &t);
+    if(!found)
+        return; //left as it is in the file, like relocSymbolic does
+
+    Elf64_Addr *dest = (void *)(lib->addr + r->r_offset);
+    switch (ELF64_R_TYPE(r->r_info))
+    {
+    case R_X86_64_DTPMOD64:
+        *dest = t.modid;
+        break;
+    case R_X86_64_DTPOFF64:
+        *dest = t.offset + r->r_addend;
+        break;
+    case R_X86_64_TPOFF64:
+        if(!t.is_static)
+        {
+            fprintf(stderr, "tls error: %s wants %s in static TLS, but it isn't there\n",
+                lib->name, strtab + sym->st_name);
+            exit(-1);
+        }
+        *dest = t.tpoff + t.offset + r->r_addend;
+        break;
+    }
+}
+
+void tlsRelease(Library *lib)
+{
+    //the slot can be reused at once, other threads free their stale blocks when they see the new gen
+    if(!lib->tls_modid)
+        return;
+    uint64_t i = lib->tls_modid - TLS_MODID_BASE;
+    pthread_mutex_lock(&tlsLock);
+    struct tlsModule *m = &tlsModules[i];
+    __atomic_store_n(&m->gen, m->gen + 1, __ATOMIC_RELAXED);
+    m->lib = NULL;
+    struct tlsVector *v = tlsVec;
+    if(v && i < v->len && !v->e[i].is_static)
+    {
+        free(v->e[i].block);
+        v->e[i].block = NULL;
+    }
+    pthread_mutex_unlock(&tlsLock);
+    lib->tls_modid = 0;
+}
@@ -0,0 +1,79 @@
+//per library phase timings and counters, written as one JSON object per line
+//on when the library is opened with TRACE_LOAD, or for every library when $DL_REBUILD_TRACE is set.
+//$DL_REBUILD_TRACE names the file to append to, "1" or "stderr" mean stderr
+#include "library.h"
+#include "dl-rebuild.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef DL_TRACE
+
+static const char *phaseNames[TRACE_PHASES] = {
+    "resolve", "map", "dynamic", "scope", "relr", "rela", "plt"
+};
+
+static const char *counterNames[TRACE_COUNTERS] = {
+    "files_probed", "bytes_mapped", "reloc_relative", "reloc_relr", "reloc_symbolic", "reloc_jump_slot",
+    "lazy_binds", "lookups", "bloom_rejects", "chain_steps"
+};
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; //one whole line at a time
+static FILE *traceFile = NULL;
+static int traceEnv = -1; //not looked at yet
+
+static FILE *traceOutput(void)
+{
+    //call with traceLock held
+    if(traceFile)
+        return traceFile;
+    const char *path = getenv("DL_REBUILD_TRACE");
+    if(path && *path && strcmp(path, "1") != 0 && strcmp(path, "stderr") != 0)
+        traceFile = fopen(path, "a");
+    if(!traceFile)
+        traceFile = stderr;
+    return traceFile;
+}
+
+uint64_t traceClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void traceStart(Library *lib, int mode)
+{
+    if(traceEnv < 0)
+        traceEnv = getenv("DL_REBUILD_TRACE") != NULL;
+    if(!(mode & TRACE_LOAD) && !traceEnv)
+        return;
+    if(!lib->trace)
+        lib->trace = calloc(1, sizeof(struct traceData));
+}
+
+void traceReport(Library *lib, const char *event)
+{
+    //everything so far: phases are only timed once, counters like lookups keep going up
+    struct traceData *t = lib->trace;
+    if(!t)
+        return;
+    pthread_mutex_lock(&traceLock);
+    FILE *out = traceOutput();
+    fprintf(out, "{\"event\": \"%s\", \"library\": \"%s\", \"addr\": \"0x%lx\", \"phases_us\": {",
+        event, lib->name, lib->addr);
+    for(int i = 0; i < TRACE_PHASES; i++)
+        fprintf(out, "%s\"%s\": %.3f", i ? ", " : "", phaseNames[i], t->phase_ns[i] / 1e3);
+    fprintf(out, "}, \"counters\": {");
+    for(int i = 0; i < TRACE_COUNTERS; i++)
+        fprintf(out, "%s\"%s\": %lu", i ? ", " : "", counterNames[i],
+            __atomic_load_n(&t->counters[i], __ATOMIC_RELAXED));
+    fprintf(out, "}}\n");
+    fflush(out);
+    pthread_mutex_unlock(&traceLock);
+}
+
+#endif
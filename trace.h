@@ -0,0 +1,67 @@
+//LD_DEBUG-like numbers about where an openLibrary spends its time, see trace.c
+//build with `make TRACE=1` to get them, otherwise every TRACE_ macro is empty
+#ifndef DL_TRACE_H
+#define DL_TRACE_H
+
+#include <stdint.h>
+
+enum tracePhase
+{
+    TRACE_RESOLVE, //finding the file, see resolveLibrary
+    TRACE_MAP, //mapSegment
+    TRACE_DYNAMIC, //fill_info and setup_hash
+    TRACE_SCOPE, //scopeIndexBuild
+    TRACE_RELR,
+    TRACE_RELA,
+    TRACE_PLT,
+    TRACE_PHASES
+};
+
+enum traceCounter
+{
+    TRACE_FILES_PROBED, //directories looked into and files opened
+    TRACE_BYTES_MAPPED,
+    TRACE_RELOC_RELATIVE,
+    TRACE_RELOC_RELR, //words rebased through DT_RELR
+    TRACE_RELOC_SYMBOLIC,
+    TRACE_RELOC_JUMP_SLOT, //bound at load time, or made lazy
+    TRACE_LAZY_BINDS,
+    TRACE_LOOKUPS, //of names in this library's own hash table
+    TRACE_BLOOM_REJECTS,
+    TRACE_CHAIN_STEPS,
+    TRACE_COUNTERS
+};
+
+struct traceData
+{
+    uint64_t phase_ns[TRACE_PHASES];
+    uint64_t counters[TRACE_COUNTERS];
+};
+
+#ifdef DL_TRACE
+
+struct libraryInternal;
+extern void traceStart(struct libraryInternal *lib, int mode);
+extern uint64_t traceClock(void);
+extern void traceReport(struct libraryInternal *lib, const char *event);
+
+//a Library only has lib->trace when tracing was asked for when it was opened
+#define TRACE_START(lib, mode) traceStart(lib, mode)
+#define TRACE_BEGIN(var) uint64_t var = traceClock()
+#define TRACE_END(lib, phase, var) \
+    do { if((lib)->trace) (lib)->trace->phase_ns[phase] += traceClock() - (var); } while(0)
+#define TRACE_COUNT(lib, counter, n) \
+    do { if((lib)->trace) __atomic_fetch_add(&(lib)->trace->counters[counter], (n), __ATOMIC_RELAXED); } while(0)
+#define TRACE_REPORT(lib, event) traceReport(lib, event)
+
+#else
+
+#define TRACE_START(lib, mode) do {} while(0)
+#define TRACE_BEGIN(var)
+#define TRACE_END(lib, phase, var) do {} while(0)
+#define TRACE_COUNT(lib, counter, n) do {} while(0)
+#define TRACE_REPORT(lib, event) do {} while(0)
+
+#endif
+
+#endif